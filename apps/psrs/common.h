@@ -24,15 +24,51 @@
 #include "asm/atomic.h"
 #endif
 
+/* record and key types (see qsort.h) */
+#include "qsort.h"
+typedef qelement_t element_t;
+typedef qkey_t sort_key_t;
+typedef qwide_key_t wide_key_t;
+#define KEY             QKEY
+#define WIDE_KEY_MAX    QWIDE_KEY_MAX
+
+#ifdef KEY_UNSIGNED
+#define KEY_FMT         "%llu"
+#define KEY_PRINT(k)    ((unsigned long long) (k))
+#else
+#define KEY_FMT         "%lld"
+#define KEY_PRINT(k)    ((long long) (k))
+#endif
+
+/* random keys: 31 random bits as before for 32-bit keys, all 64 bits 
+ * (negative ones too, when signed) for 64-bit keys. the payload is 
+ * filled from the key so that validation can check it moved with it */
+#if KEY_BITS == 64
+#define RANDOM_KEY()    ((sort_key_t) (((uint64_t) random() << 33) ^ \
+                            ((uint64_t) random() << 2) ^ (uint64_t) random()))
+#else
+#define RANDOM_KEY()    ((sort_key_t) random())
+#endif
+#if PAYLOAD_SIZE > 0
+#define SET_PAYLOAD(e)  memset((e).payload, (char) (e).key, PAYLOAD_SIZE)
+#define PAYLOAD_OK(e)   ((e).payload[0] == (char) (e).key && \
+                            (e).payload[PAYLOAD_SIZE - 1] == (char) (e).key)
+#else
+#define SET_PAYLOAD(e)  ((void) 0)
+#define PAYLOAD_OK(e)   1
+#endif
+
 /* for custom qsort */
 #define CUSTOM_QSORT  /* default */
 #ifdef CUSTOM_QSORT
-#include "qsort.h"
 #define QUICKSORT _qsort
-typedef qelement_t element_t;
 #else
 #define QUICKSORT qsort
-typedef int element_t;
+#endif
+
+/* local sort engine for phase 1: quicksort (default) or LSD radix sort */
+#ifdef RADIX_SORT
+#include "radixsort.h"
 #endif
 
 /* thread/sync primitives from various platforms */
@@ -169,6 +205,16 @@ typedef int element_t;
 #define _PAGE_OFFSET_MASK (_PAGE_SIZE - 1)
 #define _PAGE_MASK        (~_PAGE_OFFSET_MASK)
 
+/* first record starting in its page, scanning up / last one, scanning 
+ * down. records need not divide the page, so test the offset range */
+#define PAGE_FIRST(addr)    (((unsigned long)(addr) & _PAGE_OFFSET_MASK) \
+                                < sizeof(element_t))
+#define PAGE_LAST(addr)     (((unsigned long)(addr) & _PAGE_OFFSET_MASK) \
+                                >= _PAGE_SIZE - sizeof(element_t))
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE   64
+#endif
+
 #ifndef likely
 #define likely(x) __builtin_expect(!!(x), 1)
 #endif
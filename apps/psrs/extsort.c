@@ -0,0 +1,325 @@
+#include <aio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "extsort.h"
+
+/* 
+ * all file offsets and i/o lengths are page multiples so that the same 
+ * code works with O_DIRECT; each run starts at a page boundary of the 
+ * runs file and the padding after it is never read as keys
+ */
+#define ROUND_UP(x)     (((x) + _PAGE_SIZE - 1) & _PAGE_MASK)
+
+#ifdef EXT_DIRECT_IO
+#define EXT_OPEN_FLAGS  O_DIRECT
+#else
+#define EXT_OPEN_FLAGS  0
+#endif
+
+/* a run being merged: two read buffers, one consumed while the next 
+ * chunk of the run is read into the other */
+struct ext_run {
+	off_t off;              /* next byte of the run to read */
+	size_t left;            /* keys not yet read */
+	element_t* buf[2];
+	int cur;
+	size_t pos;             /* next key in buf[cur] */
+	size_t len;             /* valid keys in buf[cur] */
+	size_t next_len;        /* keys the pending read will yield */
+	bool pending;
+	struct aiocb cb;
+};
+
+/* output: filled one buffer at a time, written out behind the merge */
+struct ext_out {
+	int fd;
+	off_t off;
+	element_t* buf[2];
+	int cur;
+	size_t len;
+	bool pending;
+	struct aiocb cb;
+};
+
+static void* ext_alloc(size_t bytes) {
+	void* p = aligned_alloc(_PAGE_SIZE, ROUND_UP(bytes));
+	assert(p);
+	return p;
+}
+
+/* waits for an outstanding request, returns its byte count */
+static ssize_t ext_wait(struct aiocb* cb) {
+	const struct aiocb* list[1] = { cb };
+	ssize_t ret;
+	while (aio_error(cb) == EINPROGRESS)
+		aio_suspend(list, 1, NULL);
+	ret = aio_return(cb);
+	if (ret < 0) {
+		perror("extsort: aio");
+		exit(1);
+	}
+	return ret;
+}
+
+static void ext_pwrite(int fd, void* buf, size_t bytes, off_t off) {
+	ssize_t ret;
+	while (bytes > 0) {
+		ret = pwrite(fd, buf, bytes, off);
+		if (ret < 0) {
+			perror("extsort: pwrite");
+			exit(1);
+		}
+		buf = (char*) buf + ret;
+		bytes -= ret;
+		off += ret;
+	}
+}
+
+/* starts reading the next chunk of run r into its spare buffer */
+static void ext_read_ahead(struct ext_run* r, int fd, size_t buf_keys) {
+	size_t keys = r->left < buf_keys ? r->left : buf_keys;
+	if (keys == 0)
+		return;
+	memset(&r->cb, 0, sizeof(r->cb));
+	r->cb.aio_fildes = fd;
+	r->cb.aio_offset = r->off;
+	r->cb.aio_buf = r->buf[1 - r->cur];
+	r->cb.aio_nbytes = ROUND_UP(keys * sizeof(element_t));
+	if (aio_read(&r->cb)) {
+		perror("extsort: aio_read");
+		exit(1);
+	}
+	r->off += r->cb.aio_nbytes;
+	r->left -= keys;
+	r->next_len = keys;
+	r->pending = true;
+}
+
+/* makes the next key of run r available; false once it is exhausted */
+static bool ext_refill(struct ext_run* r, int fd, size_t buf_keys) {
+	if (!r->pending)
+		return false;
+	ext_wait(&r->cb);
+	r->pending = false;
+	r->cur = 1 - r->cur;
+	r->pos = 0;
+	r->len = r->next_len;
+	ext_read_ahead(r, fd, buf_keys);
+	return true;
+}
+
+/* writes out the current output buffer and switches to the other one */
+static void ext_flush(struct ext_out* o) {
+	if (o->pending)
+		ext_wait(&o->cb);
+	memset(&o->cb, 0, sizeof(o->cb));
+	o->cb.aio_fildes = o->fd;
+	o->cb.aio_offset = o->off;
+	o->cb.aio_buf = o->buf[o->cur];
+	o->cb.aio_nbytes = ROUND_UP(o->len * sizeof(element_t));
+	if (aio_write(&o->cb)) {
+		perror("extsort: aio_write");
+		exit(1);
+	}
+	o->pending = true;
+	o->off += o->len * sizeof(element_t);
+	o->cur = 1 - o->cur;
+	o->len = 0;
+}
+
+/*
+ * k-way merge of the runs with a loser tree as in phase 4 of the 
+ * in-memory sort: leaves padded to a power of two, exhausted runs play 
+ * as WIDE_KEY_MAX
+ */
+static void ext_merge(int in, struct ext_run* runs, int k, 
+	size_t buf_keys, struct ext_out* o)
+{
+	int n, w, l, a, b, leaves;
+	wide_key_t kw, *key;
+	int *tree, *win;
+
+	for (leaves = 1; leaves < k; leaves *= 2);
+	tree = malloc(leaves * sizeof(int));
+	win = malloc(2 * leaves * sizeof(int));
+	key = malloc(leaves * sizeof(wide_key_t));
+	assert(tree && win && key);
+
+	for (w = 0; w < leaves; w++) {
+		key[w] = WIDE_KEY_MAX;
+		if (w < k && ext_refill(&runs[w], in, buf_keys))
+			key[w] = KEY(runs[w].buf[runs[w].cur][0]);
+		win[leaves + w] = w;
+	}
+	for (n = leaves - 1; n >= 1; n--) {
+		a = win[2*n];
+		b = win[2*n + 1];
+		if (key[b] < key[a]) { tree[n] = a; win[n] = b; }
+		else { tree[n] = b; win[n] = a; }
+	}
+	w = win[1];
+
+	while (key[w] != WIDE_KEY_MAX) {
+		struct ext_run* r = &runs[w];
+		o->buf[o->cur][o->len++] = r->buf[r->cur][r->pos];
+		if (o->len == buf_keys)
+			ext_flush(o);
+
+		/* next key of the winning run */
+		if (++r->pos == r->len && !ext_refill(r, in, buf_keys))
+			key[w] = WIDE_KEY_MAX;
+		else
+			key[w] = KEY(r->buf[r->cur][r->pos]);
+
+		/* replay its path */
+		kw = key[w];
+		for (n = (leaves + w) / 2; n >= 1; n /= 2) {
+			l = tree[n];
+			if (key[l] < kw) {
+				tree[n] = w;
+				w = l;
+				kw = key[l];
+			}
+		}
+	}
+	if (o->len)
+		ext_flush(o);
+	if (o->pending)
+		ext_wait(&o->cb);
+
+	free(tree);
+	free(win);
+	free(key);
+}
+
+/* reads the output back sequentially and checks its order */
+static void ext_check(int fd, size_t nkeys, element_t* buf, size_t buf_keys) {
+	size_t done = 0, i, keys;
+	sort_key_t prev = 0;
+	ssize_t ret;
+	while (done < nkeys) {
+		keys = nkeys - done < buf_keys ? nkeys - done : buf_keys;
+		ret = pread(fd, buf, ROUND_UP(keys * sizeof(element_t)), 
+			done * sizeof(element_t));
+		if (ret < (ssize_t) (keys * sizeof(element_t))) {
+			printf("not sorted: short read at key %lu\n", done);
+			return;
+		}
+		for (i = 0; i < keys; i++, done++) {
+			if (done > 0 && prev > KEY(buf[i])) {
+				printf("not sorted: " KEY_FMT " > " KEY_FMT "\n", 
+					KEY_PRINT(prev), KEY_PRINT(KEY(buf[i])));
+				return;
+			}
+			if (!PAYLOAD_OK(buf[i])) {
+				printf("not sorted: payload of key " KEY_FMT " corrupted\n",
+					KEY_PRINT(KEY(buf[i])));
+				return;
+			}
+			prev = KEY(buf[i]);
+		}
+	}
+	printf("sorted\n");
+}
+
+int extsort(const char* path, size_t nkeys, size_t run_keys, 
+	run_sorter_t sort_run)
+{
+	char runs_path[PATH_MAX], out_path[PATH_MAX];
+	int in, out, nruns, i;
+	size_t keys, run_bytes, buf_keys;
+	element_t *keybuf, *scratch, *sorted;
+	struct ext_run* runs;
+	struct ext_out o;
+	struct timeval* time_start;
+	struct timeval* all_start = get_time();
+
+	if (run_keys == 0 || run_keys > nkeys)
+		run_keys = nkeys;
+	nruns = (nkeys + run_keys - 1) / run_keys;
+	run_bytes = ROUND_UP(run_keys * sizeof(element_t));
+	snprintf(runs_path, sizeof(runs_path), "%s.runs", path);
+	snprintf(out_path, sizeof(out_path), "%s.sorted", path);
+	in = open(runs_path, O_RDWR | O_CREAT | O_TRUNC | EXT_OPEN_FLAGS, 0644);
+	out = open(out_path, O_RDWR | O_CREAT | O_TRUNC | EXT_OPEN_FLAGS, 0644);
+	if (in < 0 || out < 0) {
+		perror("extsort: open");
+		exit(1);
+	}
+	printf("external sort: %d runs of %lu keys\n", nruns, run_keys);
+
+	/* run formation: generate, sort in memory, spill. the keys are the 
+	 * same as the in-memory mode's */
+	checkpoint("runs");
+	time_start = get_time();
+	keybuf = ext_alloc(run_bytes);
+	scratch = ext_alloc(run_bytes);
+	memset(scratch, 0, run_bytes);
+	srandom(15);
+	for (i = 0; i < nruns; i++) {
+		keys = (i == nruns - 1) ? nkeys - (size_t) i * run_keys : run_keys;
+		for (size_t j = 0; j < keys; j++) {
+			KEY(keybuf[j]) = RANDOM_KEY();
+			SET_PAYLOAD(keybuf[j]);
+		}
+		sorted = sort_run(keybuf, scratch, keys);
+		ext_pwrite(in, sorted, ROUND_UP(keys * sizeof(element_t)), 
+			(off_t) i * run_bytes);
+	}
+	free(keybuf);
+	free(scratch);
+	printf("runs took %ld ms\n", end_timing(time_start));
+
+	/* merge: the two run buffers' worth of memory is split among the 
+	 * 2 read buffers of each run and the 2 output buffers */
+	checkpoint("merge");
+	time_start = get_time();
+	/* in whole pages' worth of records, so that every full buffer is a
+	 * page multiple whatever the record size */
+	buf_keys = 2 * run_bytes / (2 * nruns + 2) / 
+		(_PAGE_SIZE * sizeof(element_t));
+	if (buf_keys == 0)
+		buf_keys = 1;
+	buf_keys *= _PAGE_SIZE;
+	runs = calloc(nruns, sizeof(struct ext_run));
+	assert(runs);
+	for (i = 0; i < nruns; i++) {
+		runs[i].off = (off_t) i * run_bytes;
+		runs[i].left = (i == nruns - 1) ? 
+			nkeys - (size_t) i * run_keys : run_keys;
+		runs[i].buf[0] = ext_alloc(buf_keys * sizeof(element_t));
+		runs[i].buf[1] = ext_alloc(buf_keys * sizeof(element_t));
+		runs[i].cur = 1;	/* first refill swaps to buf[0] */
+		ext_read_ahead(&runs[i], in, buf_keys);
+	}
+	memset(&o, 0, sizeof(o));
+	o.fd = out;
+	o.buf[0] = ext_alloc(buf_keys * sizeof(element_t));
+	o.buf[1] = ext_alloc(buf_keys * sizeof(element_t));
+	ext_merge(in, runs, nruns, buf_keys, &o);
+	/* the last write was padded to a page */
+	if (ftruncate(out, nkeys * sizeof(element_t))) {
+		perror("extsort: ftruncate");
+		exit(1);
+	}
+	printf("merge took %ld ms\n", end_timing(time_start));
+	printf("took: %ld ms (microseconds)\n", end_timing(all_start));
+
+	ext_check(out, nkeys, o.buf[0], buf_keys);
+
+	for (i = 0; i < nruns; i++) {
+		free(runs[i].buf[0]);
+		free(runs[i].buf[1]);
+	}
+	free(runs);
+	free(o.buf[0]);
+	free(o.buf[1]);
+	close(in);
+	close(out);
+	unlink(runs_path);
+	return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __EXTSORT_H__
+#define __EXTSORT_H__
+
+#include <stddef.h>
+#include "common.h"
+
+/*
+ * out-of-core sort: the input is generated one run of run_keys keys at a 
+ * time, each run is sorted in memory by the run sorter and spilled to 
+ * <path>.runs, then all runs are k-way merged into <path>.sorted with 
+ * double-buffered asynchronous reads and writes. peak memory is about 
+ * two runs' worth of keys, whatever the total size.
+ *
+ * build with EXT_DIRECT_IO to bypass the page cache (O_DIRECT).
+ */
+
+/* sorts keys[0, n), using scratch[0, n) as it likes; returns whichever 
+ * of the two holds the result */
+typedef element_t* (*run_sorter_t)(element_t* keys, element_t* scratch, 
+	size_t n);
+
+int extsort(const char* path, size_t nkeys, size_t run_keys, 
+	run_sorter_t sort_run);
+
+/* from main.c */
+struct timeval* get_time();
+long int end_timing(struct timeval* start);
+void checkpoint(char* name);
+
+#endif /* ifndef __EXTSORT_H__ */
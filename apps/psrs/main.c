@@ -7,6 +7,15 @@
 #include <sys/time.h>
 
 #include "common.h"
+#ifdef EXTERNAL_SORT
+#include "extsort.h"
+#endif
+#ifdef NUMA_PLACEMENT
+#ifdef SHENANGO
+#error "NUMA_PLACEMENT pins pthreads; shenango places its own kthreads"
+#endif
+#include "topology.h"
+#endif
 
 /* local macros */
 #define master if (id == 0) 
@@ -17,28 +26,47 @@
 
 /* global data */
 size_t size; 
-size_t w; 
 int t;
-int ro; 
+
+/* regular samples taken per thread are OVERSAMPLE * t (classic PSRS: 1) */
+#ifndef OVERSAMPLE
+#define OVERSAMPLE 1
+#endif
+int st;
+
+#ifdef EXTERNAL_SORT
+/* keys sorted in memory at a time, and where the runs spill to */
+size_t ext_run_keys;
+char* ext_path;
+#endif
 
 /* 
  * input array
  */
 element_t* input;
 /*
- * regular_samples is an array of t*t elements where each thread writes 
- * local samples to their own parts (disjoint) of the array.
+ * regular_samples is an array of t*st elements where each thread writes 
+ * local samples to their own parts (disjoint) of the array. each part
+ * comes out of a sorted chunk, so it is a sorted run itself.
  *
  * gets generated in phase 1, and used in phase 2
  */
-element_t* regular_samples;
+sort_key_t* regular_samples;
 /*
- * pivots is an array of t - 1 elements, and is written to only once by the master thread, 
- * and afterwards is accessed in read-only fashion by the worker threads. 
+ * pivots is an array of t - 1 elements; pivot i is written once by thread 
+ * i+1 and afterwards is accessed in read-only fashion by the worker threads. 
  *
  * it stores pivots in phase 2
  */
-element_t* pivots;
+sort_key_t* pivots;
+/*
+ * pivot_fracs is an array of t - 1 elements: the fraction of the keys 
+ * equal to pivot i that go to the left of the split, so that runs of 
+ * duplicate keys get spread across partitions.
+ *
+ * it is written along with the pivots in phase 2
+ */
+double* pivot_fracs;
 /*
  * partitions is an array of size t * (t + 1). 
  * it can be considered as a 2d array where each thread writes the partition indices to its own row. 
@@ -57,6 +85,11 @@ size_t* merged_partition_length;
  * output array for merged values
  */
 element_t* merged_values;
+/*
+ * whichever of input/merged_values holds the sorted keys once the sort
+ * is done (the buffers ping-pong between phases, nothing is copied back)
+ */
+element_t* sorted_values;
 
 struct thread_data {
 	int id;
@@ -67,84 +100,313 @@ struct thread_data {
 BARRIER_T barrier;
 
 int cmpfunc(const void* a, const void* b);
-void is_sorted();
+void is_sorted(element_t* array);
 struct timeval* get_time();
 long int end_timing(struct timeval* start);
-int* generate_array_of_size(size_t size);
-void print_array(int* array, size_t size);
+element_t* generate_array_of_size(size_t size);
+void fill_array(element_t* array, size_t size);
+void print_array(element_t* array, size_t size);
 void fwrite_number(char* name, unsigned long number);
 void checkpoint(char* name);
+void print_imbalance();
+
+/* chunk j of the input, the same split as sort_input */
+static size_t chunk_size(int j) {
+	return j < t - 1 ? size / t : size - (t - 1) * (size / t);
+}
+
+/* index of the last element of slice i when a chunk of len is cut in st */
+static size_t sample_index(size_t len, int i) {
+	return ((i + 1) * len + st - 1) / st - 1;
+}
 
 /*
  * phase 1
  * does the local sorting of the array, and collects sample.
+ * built with RADIX_SORT, the local sort is an LSD radix sort
  */
 void phase1(struct thread_data* data) {
 	size_t start = data->start;
 	size_t end = data->end;
 	int id = data->id;
 	
+#ifdef RADIX_SORT
+	/* the output buffer is unused until phase 4: scratch for the passes */
+	_radixsort((input + start), (merged_values + start), (end - start));
+#else
 	QUICKSORT((input + start), (end - start), sizeof(element_t), cmpfunc);
+#endif
 
-	/* regular sampling */
-	int ix = 0;
-	for (int i = 0; i < t; i++) {
-		regular_samples[id * t + ix] = input[start + (i * w)];
-		ix++;
+	/* regular sampling: the last key of each of st equal slices */
+	size_t len = end - start;
+	for (int i = 0; i < st; i++)
+		regular_samples[id * st + i] = len == 0 ? KEY(input[start]) :
+			KEY(input[start + sample_index(len, i)]);
+}
+
+/* 
+ * estimated number of keys not above v in all the chunks. a sample 
+ * gives the exact rank of its key in its chunk, and the ranks in between 
+ * are interpolated linearly over key values. key v is taken to cover 
+ * [v - 1/2, v + 1/2), so duplicates of a sample are assumed to run half 
+ * way to the next one; below the first sample of a chunk, the slope of 
+ * the first slice is carried down
+ */
+static double estimate_rank(wide_key_t v) {
+	double count = 0, below;
+	size_t lo, hi, mid, len, p0, p1;
+	sort_key_t* run;
+	for (int j = 0; j < t; j++) {
+		run = &regular_samples[j * st];
+		len = chunk_size(j);
+		if (len == 0)
+			continue;
+		for (lo = 0, hi = st; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			if (run[mid] <= v)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == st) {
+			/* the last sample is the largest key */
+			count += len;
+		} else if (lo > 0) {
+			p0 = sample_index(len, lo - 1);
+			p1 = sample_index(len, lo);
+			count += p0 + 1 + (double) (p1 - p0) * (v - run[lo - 1] + 0.5)
+				/ (double) ((wide_key_t) run[lo] - run[lo - 1]);
+		} else if (st > 1 && run[1] > run[0]) {
+			p0 = sample_index(len, 0);
+			p1 = sample_index(len, 1);
+			below = p0 + 1 - (double) (p1 - p0) * (run[0] - v - 0.5)
+				/ (double) ((wide_key_t) run[1] - run[0]);
+			if (below > 0)
+				count += below;
+		}
 	}
+	return count;
 }
 
 /*
  * phase 2
- * sequential part of the algorithm. determines pivots based on the regular samples provided.
+ * determines pivots based on the regular samples provided. the samples 
+ * are t sorted runs, so instead of the master sorting them all, thread 
+ * i (1 <= i < t) selects pivot i-1 as the smallest key whose estimated 
+ * rank reaches i*size/t, by bisecting over key values; pivots are found 
+ * in parallel. the estimate is interpolated between samples, so it gets 
+ * closer with more of them (OVERSAMPLE) when keys are not spread evenly.
  */
 void phase2(struct thread_data* data) {
 	int id = data->id;
-	master { 	
-		QUICKSORT(regular_samples, t*t, sizeof(element_t), cmpfunc);
-		int ix = 0;
-		for (int i = 1; i < t; i++) {
-			int pos = t * i + ro - 1;
-			pivots[ix++] = regular_samples[pos];
+	double rank, lt, le;
+	wide_key_t lo, hi, mid;
+
+	if (id == 0)
+		return;
+
+	rank = (double) size * id / t;
+	lo = hi = regular_samples[0];
+	for (int j = 0; j < t; j++) {
+		if (regular_samples[j * st] < lo)	lo = regular_samples[j * st];
+		if (regular_samples[j * st + st - 1] > hi)	hi = regular_samples[j * st + st - 1];
+	}
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (estimate_rank(mid) >= rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	pivots[id - 1] = (sort_key_t) lo;
+
+	/* duplicates of the pivot: send only enough of them left to make 
+	 * up the rank */
+	lt = estimate_rank(lo - 1);
+	le = estimate_rank(lo);
+	pivot_fracs[id - 1] = rank <= lt ? 0 : rank >= le ? 1 : 
+		(rank - lt) / (le - lt);
+}
+
+/*
+ * first index in input[lo, hi) holding a key above pivot (upper) or not 
+ * below it (hi if none).
+ * the range is sorted, so this is a binary search that only touches
+ * O(log n) elements; each probe that lands on a new page gets a hint
+ */
+static size_t bound(size_t lo, size_t hi, sort_key_t pivot, bool upper) {
+	unsigned long page, last_page = -1UL;
+	size_t mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		page = (unsigned long)&input[mid] & _PAGE_MASK;
+		if (page != last_page) {
+			HINT_READ_FAULT((void*)page);
+			last_page = page;
 		}
+		if (pivot < KEY(input[mid]) || (!upper && pivot == KEY(input[mid])))
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
+	return lo;
 }
 
 /*
  * phase 3
- * local splitting of the data based on the pivots
+ * local splitting of the data based on the pivots. the chunk is sorted
+ * after phase 1, so each split point is a binary search starting from
+ * the previous one; pivots that fall before the same element or above
+ * the whole chunk leave empty partitions. keys equal to a pivot are 
+ * split by its pivot_fracs share
  */
 void phase3(struct thread_data* data) {
 	size_t start = data->start;
 	size_t end = data->end;
 	int id = data->id;
+	size_t eq_lo = start, eq_hi;
 
-	int pi = 0; // pivot counter
-	int pc = 1; // partition counter
 	partitions[id*(t+1)+0] = start;
 	partitions[id*(t+1)+t] = end;
-	for (size_t i = start; i < end && pi != t-1; i++) {
-		if (((unsigned long)&input[i] & _PAGE_OFFSET_MASK) == 0)
-			HINT_READ_FAULT(&input[i]);
-		if (pivots[pi] < input[i]) {
-			partitions[id*(t+1) + pc] = i;
-			pc++;
-			pi++;
-		}
+	for (int pi = 0; pi < t-1; pi++) {
+		/* search from the previous pivot's run of equal keys, not its
+		 * split: consecutive pivots may share a key */
+		eq_lo = bound(eq_lo, end, pivots[pi], false);
+		eq_hi = bound(eq_lo, end, pivots[pi], true);
+		partitions[id*(t+1) + pi + 1] = eq_lo + 
+			(size_t) (pivot_fracs[pi] * (eq_hi - eq_lo) + 0.5);
 	}
 }
 
 /*
- * merges the array with a given size into the original input array
+ * loser tree for the k-way merge: one leaf per run, padded with empty 
+ * runs to a power of two. internal node n keeps the run that lost the 
+ * match at n and tree[0] the overall winner, so each output element 
+ * costs a single leaf-to-root replay of log2(k) comparisons instead of 
+ * a scan over all runs. keys at the heads of the runs are cached in 
+ * key[], widened so that an exhausted run can play as LT_DONE (+infinity)
+ * and the replay needs no branches
  */
-void copyback(element_t* data, size_t start_pos, size_t len) {
-	for (size_t i = start_pos; i < start_pos + len; i++) {
-		if (((unsigned long)&data[i] & _PAGE_OFFSET_MASK) == 0)
-			HINT_READ_FAULT_OPT_RDAHEAD(&data[i]);
-		if (((unsigned long)&input[i] & _PAGE_OFFSET_MASK) == 0)
-			HINT_WRITE_FAULT_OPT_RDAHEAD(&input[i]);
-		input[i] = data[i];
+typedef wide_key_t lt_key_t;
+#define LT_DONE WIDE_KEY_MAX
+
+/* records per output block: a cache line, or one record if larger */
+#define LINE_ELEMS	(sizeof(element_t) < CACHE_LINE_SIZE ? \
+	CACHE_LINE_SIZE / sizeof(element_t) : 1)
+
+struct loser_tree {
+	int k;					/* leaves, a power of two */
+	int* tree;				/* [k] */
+	lt_key_t* key;			/* [k] current head of each run */
+	size_t* pos;			/* [k] */
+	size_t* end;			/* [k] */
+};
+
+/* load the head of run r, with a hint on every page crossing */
+static inline void lt_load(struct loser_tree* lt, int r) {
+	element_t* addr;
+	if (lt->pos[r] == lt->end[r]) {
+		lt->key[r] = LT_DONE;
+		return;
 	}
+	addr = &input[lt->pos[r]];
+	if (PAGE_FIRST(addr))
+		HINT_READ_FAULT_RDAHEAD(addr, MERGE_RDAHEAD);
+	lt->key[r] = KEY(*addr);
+}
+
+/*
+ * merges the sorted runs input[runs[2i], runs[2i+1]) into out, which 
+ * takes len elements. output goes out a cache line at a time. returns
+ * the number of elements merged
+ */
+size_t merge_runs(size_t* runs, element_t* out, size_t len) {
+	struct loser_tree lt;
+	int i, n, w, l, a, b, tmp;
+	size_t mi = 0, blk, nblk;
+	lt_key_t kw;
+	element_t* addr;
+	element_t buf[LINE_ELEMS];
+	unsigned long first, last;
+
+	if (len == 0)
+		return 0;
+
+	for (lt.k = 1; lt.k < t; lt.k *= 2);
+	lt.tree = malloc(lt.k * sizeof(int));
+	lt.key = malloc(lt.k * sizeof(lt_key_t));
+	lt.pos = malloc(lt.k * sizeof(size_t));
+	lt.end = malloc(lt.k * sizeof(size_t));
+	assert(lt.tree && lt.key && lt.pos && lt.end);
+	for (i = 0; i < lt.k; i++) {
+		lt.pos[i] = lt.end[i] = 0;
+		if (i < t) {
+			lt.pos[i] = runs[2*i];
+			lt.end[i] = runs[2*i + 1];
+		}
+		lt_load(&lt, i);
+	}
+
+	/* build bottom-up: leaf i sits at k + i; winners move up, losers 
+	 * stay at the node they lost at */
+	int* win = malloc(2 * lt.k * sizeof(int));
+	assert(win);
+	for (i = 0; i < lt.k; i++)
+		win[lt.k + i] = i;
+	for (n = lt.k - 1; n >= 1; n--) {
+		a = win[2*n];
+		b = win[2*n + 1];
+		if (lt.key[b] < lt.key[a]) { tmp = a; a = b; b = tmp; }
+		lt.tree[n] = b;
+		win[n] = a;
+	}
+	lt.tree[0] = win[1];
+	free(win);
+
+	/* first block only runs up to the next cache line boundary */
+	nblk = (CACHE_LINE_SIZE - ((unsigned long) out % CACHE_LINE_SIZE)) 
+		/ sizeof(element_t);
+	if (nblk == 0 || nblk > LINE_ELEMS)
+		nblk = 1;
+	blk = 0;
+	while (mi < len) {
+		w = lt.tree[0];
+		assert(lt.key[w] != LT_DONE);
+		buf[blk++] = input[lt.pos[w]];
+		lt.pos[w]++;
+		lt_load(&lt, w);
+
+		/* replay the winner's path */
+		kw = lt.key[w];
+		for (n = (lt.k + w) / 2; n >= 1; n /= 2) {
+			l = lt.tree[n];
+			if (lt.key[l] < kw) {
+				lt.tree[n] = w;
+				w = l;
+				kw = lt.key[l];
+			}
+		}
+		lt.tree[0] = w;
+
+		mi++;
+		if (blk == nblk || mi == len) {
+			addr = &out[mi - blk];
+			/* hint if the block starts a page or runs into the next */
+			first = (unsigned long) addr & _PAGE_MASK;
+			last = ((unsigned long) (addr + blk) - 1) & _PAGE_MASK;
+			if (first != last || PAGE_FIRST(addr))
+				HINT_WRITE_FAULT_OPT_RDAHEAD((void*) last);
+			memcpy(addr, buf, blk * sizeof(element_t));
+			blk = 0;
+			nblk = LINE_ELEMS;
+		}
+	}
+
+	free(lt.tree);
+	free(lt.key);
+	free(lt.pos);
+	free(lt.end);
+	return mi;
 }
 
 /*
@@ -177,60 +439,19 @@ void phase4(struct thread_data* data) {
 		start_pos += merged_partition_length[i];
 	assert(start_pos + total_merge_length <= size);
 
-	/* k way merge
-	   in k-way merge step, basically we go through each valid partition, and find the minimum in each step
-	   then we add that minimum to the local "merged_values" array in each step
-	   a valid partition is when rn_start < rn_end
-	   partition being invalid means that that partition has been merged completely already */
-	int mi = 0;
-	int min, min_pos;
-	element_t* addr;
-	while (mi < total_merge_length) {
-		/* find the next min element of all sorted partitions */
-		bool found = false;
-		for (int i = 0; i < t * 2; i += 2) {
-			if (exchange_indices[i] != exchange_indices[i+1]) {
-				addr = &input[exchange_indices[i]];
-				if (((unsigned long) addr & _PAGE_OFFSET_MASK) == 0)
-					HINT_READ_FAULT_RDAHEAD(addr, MERGE_RDAHEAD);
-				if (!found) {
-					min = *addr;
-					min_pos = i;
-					found = true;
-					continue;
-				}
-				
-				if (*addr < min) {
-					min = *addr;
-					min_pos = i;
-				}
-			}
-		}
-
-		/* nothing left */
-		if(!found)
-			break;
-
-		// save the minimum to the final array
-		addr = &merged_values[start_pos + mi];
-		if (((unsigned long) addr & _PAGE_OFFSET_MASK) == 0)
-			HINT_WRITE_FAULT_OPT_RDAHEAD(addr);
-		*addr = min;
-		// increase the counter of the range that 
-		// the minimum value belongs to
-		exchange_indices[min_pos]++;
-		mi++;
-	}
+	/* k way merge with a loser tree (see merge_runs) */
+	size_t mi = merge_runs(exchange_indices, &merged_values[start_pos], 
+		total_merge_length);
 	assert(mi == total_merge_length);
 
+	/* no copyback into input: the merged buffer is the result. the
+	 * checkpoint is still written so show.sh's phase split holds */
 	BARRIER;
 	master { 
 		RFREE(partitions);
+		sorted_values = merged_values;
 		checkpoint("copyback"); 
 	}
-	BARRIER;
-
-	copyback(merged_values, start_pos, total_merge_length);
 }
 
 #ifdef SHENANGO
@@ -245,6 +466,11 @@ void* psrs(void *args) {
 	struct timeval* time_start;
 	long int duration;
 
+#ifdef NUMA_PLACEMENT
+	/* run where the chunk was first touched */
+	topo_pin(id, t);
+#endif
+
 	/* phase 1 */
 	master { checkpoint("phase1"); }
 	time_start = get_time();
@@ -279,6 +505,7 @@ void* psrs(void *args) {
 		duration = end_timing(time_start);
 		printf("phase 3 took %ld ms\n", duration);
 		RFREE(pivots); 
+		RFREE(pivot_fracs); 
 	}
 	
 	/* phase 4 */
@@ -290,6 +517,7 @@ void* psrs(void *args) {
 	master { 
 		duration = end_timing(time_start);
 		printf("phase 4 took %ld ms\n", duration);
+		print_imbalance();
 		RFREE(merged_partition_length); 
 	}
 
@@ -307,31 +535,68 @@ struct thread_data* get_thread_data(int id, size_t per_thread) {
 }
 
 
-void main_thread(void* arg) {
+#ifdef NUMA_PLACEMENT
+/* 
+ * first-touch: each worker, pinned where it will run, zeroes its own 
+ * chunk of input and merged_values so that those pages are allocated 
+ * on its numa node rather than on the master's
+ */
+void* touch_chunk(void* args) {
+	struct thread_data* data = (struct thread_data*) args;
+	size_t len = (data->end - data->start) * sizeof(element_t);
+	topo_pin(data->id, t);
+	memset(&input[data->start], 0, len);
+	memset(&merged_values[data->start], 0, len);
+	free(data);
+	return NULL;
+}
+
+void first_touch() {
 	size_t per_thread = size / t;
-	BARRIER_INIT(&barrier, t);
+	pthread_t* threads = malloc(sizeof(pthread_t) * t);
+	char line[4096];
+	size_t n = 0;
+	int i;
 
-	/* initializing/allocating data */
-	checkpoint("start");
-	input = generate_array_of_size(size);
+	for (i = 0; i < t; i++) {
+		struct thread_data* data = get_thread_data(i, per_thread);
+		if (i == t - 1)
+			data->end = size;	/* same split as sort_input */
+		pthread_create(&threads[i], NULL, touch_chunk, data);
+		n += snprintf(line + n, n < sizeof(line) ? sizeof(line) - n : 0, 
+			" %d:%d", i, topo_cpu_for(i, t));
+	}
+	for (i = 0; i < t; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pr_info("worker:cpu placement%s", line);
+}
+#endif
 
-	/* alloc all intermediate buffers. memset all to touch all pages before 
-	 * starting the work */
-	regular_samples = RMALLOC(sizeof(element_t)*t*t);
-	memset(regular_samples, 0, sizeof(element_t)*t*t);
-	pivots = RMALLOC(sizeof(element_t) * (t - 1));
-	memset(pivots, 0, sizeof(element_t) * (t - 1));
+/* 
+ * alloc all intermediate buffers of one sort. memset all to touch all 
+ * pages before starting the work
+ */
+void alloc_buffers() {
+	regular_samples = RMALLOC(sizeof(sort_key_t)*t*st);
+	memset(regular_samples, 0, sizeof(sort_key_t)*t*st);
+	pivots = RMALLOC(sizeof(sort_key_t) * (t - 1));
+	memset(pivots, 0, sizeof(sort_key_t) * (t - 1));
+	pivot_fracs = RMALLOC(sizeof(double) * (t - 1));
+	memset(pivot_fracs, 0, sizeof(double) * (t - 1));
 	merged_partition_length = RMALLOC(sizeof(size_t) * t);
 	memset(merged_partition_length, 0, sizeof(size_t) * t);
 	partitions = RMALLOC(sizeof(size_t) *  t * (t+1));
 	memset(partitions, 0, sizeof(size_t) * t * (t+1));
-	merged_values = RMALLOC(sizeof(element_t) * size);		/* output buffer */	
-	memset(merged_values, 0, sizeof(element_t) * size);
-	pr_info("output buffer: start: %p size %lu", 
-		merged_values, sizeof(element_t) * size);
+}
 
-	/* start worker threads */
-	start_time;	
+/*
+ * sorts input[0, size) on t threads (merging into merged_values) and 
+ * returns once the master is done; the result is in sorted_values. the 
+ * intermediate buffers are freed by psrs as it goes
+ */
+void sort_input() {
+	size_t per_thread = size / t;
 	THREAD_T* threads = malloc(sizeof(THREAD_T) * t);
 	int i = 1;
 	for (; i < t - 1; i++) {
@@ -349,30 +614,91 @@ void main_thread(void* arg) {
 	/* master thread */
 	struct thread_data* data_master = get_thread_data(0, per_thread);
 	psrs((void *) data_master);
+	free(threads);
+}
+
+#ifdef EXTERNAL_SORT
+/* run sorter for the external sort: psrs over one in-memory run */
+element_t* sort_run(element_t* keys, element_t* scratch, size_t n) {
+	input = keys;
+	merged_values = scratch;
+	size = n;
+	alloc_buffers();
+	sort_input();
+	return sorted_values;
+}
+#endif
+
+void main_thread(void* arg) {
+	BARRIER_INIT(&barrier, t);
+#ifdef NUMA_PLACEMENT
+	if (topo_init()) {
+		fprintf(stderr, "cannot read the cpu topology\n");
+		exit(1);
+	}
+#endif
+
+#ifdef EXTERNAL_SORT
+	checkpoint("start");
+	extsort(ext_path, size, ext_run_keys, sort_run);
+	checkpoint("end");
+#else
+	/* initializing/allocating data */
+	checkpoint("start");
+#ifdef NUMA_PLACEMENT
+	/* place the pages before the master writes the keys */
+	input = RMALLOC(sizeof(element_t) * size);
+	merged_values = RMALLOC(sizeof(element_t) * size);		/* output buffer */	
+	first_touch();
+	fill_array(input, size);
+	pr_info("input buffer: start: %p size %lu", 
+		input, sizeof(element_t) * size);
+#else
+	input = generate_array_of_size(size);
+	merged_values = RMALLOC(sizeof(element_t) * size);		/* output buffer */	
+	memset(merged_values, 0, sizeof(element_t) * size);
+#endif
+	alloc_buffers();
+	pr_info("output buffer: start: %p size %lu", 
+		merged_values, sizeof(element_t) * size);
+
+	/* start worker threads */
+	start_time;	
+	sort_input();
 	
 	long int time = end_time;
 	printf("took: %ld ms (microseconds)\n", time);
 	checkpoint("end");
 	
- 	is_sorted(); // for validation to see if the array has really been sorted
+ 	is_sorted(sorted_values); // for validation to see if the array has really been sorted
 
 	RFREE(input);
-	free(threads);
+	RFREE(merged_values);
+#endif
 	BARRIER_DESTROY(&barrier);
 }
 
 
 int main(int argc, char *argv[]){
+#ifdef EXTERNAL_SORT
+	if (argc != 5) {
+		fprintf(stderr, "4 arguments required - <size> <thread_count> "
+			"<run_size> <spill_file>\n");
+		exit(1);
+	}
+	ext_run_keys = atol(argv[3]);
+	ext_path = argv[4];
+#else
 	if (argc != 3) {
 		fprintf(stderr, "2 arguments required - <size> <thread_count>\n");
 		exit(1);
 	} 
+#endif
 	
 	/* initializing parameters */
 	size = atol(argv[1]);
 	t = atoi(argv[2]);
-	w = (size/(t*t));
-	ro 	= t / 2;
+	st = OVERSAMPLE * t;
 	printf("nkeys: %lu\n", size);
 
 	/* write pid and wait some time for the saved pid to be added to 
@@ -393,18 +719,35 @@ int main(int argc, char *argv[]){
 	return 0;
 }
 
-// checks if the input array is sorted
+// checks if the given array (of the input size) is sorted
 // used for debugging and validation reasons
-void is_sorted() {
+void is_sorted(element_t* array) {
 	for (size_t i = 0; i < size - 1; i++) {
-		if (input[i] > input[i+1]) {
-			printf("not sorted: %d > %d\n", input[i], input[i+1]);
+		if (KEY(array[i]) > KEY(array[i+1])) {
+			printf("not sorted: " KEY_FMT " > " KEY_FMT "\n", 
+				KEY_PRINT(KEY(array[i])), KEY_PRINT(KEY(array[i+1])));
+			return;	
+		}
+		if (!PAYLOAD_OK(array[i])) {
+			printf("not sorted: payload of key " KEY_FMT " corrupted\n", 
+				KEY_PRINT(KEY(array[i])));
 			return;	
 		}
 	}
 	printf("sorted\n");
 }
 
+// prints how far the largest merged partition is above the average;
+// the slowest thread sets the phase 4 time
+void print_imbalance() {
+	size_t max = 0;
+	for (int i = 0; i < t; i++)
+		if (merged_partition_length[i] > max)
+			max = merged_partition_length[i];
+	printf("partition imbalance (max/avg): %.3f\n", 
+		(double) max * t / size);
+}
+
 struct timeval* get_time() {
 	struct timeval* t = malloc(sizeof(struct timeval));
 	gettimeofday(t, NULL);
@@ -419,9 +762,17 @@ long int end_timing(struct timeval* start) {
 }
 
 // used for generating random arrays of the given size
-int* generate_array_of_size(size_t size) {
+element_t* generate_array_of_size(size_t size) {
+	element_t* randoms = RMALLOC(sizeof(element_t) * size);
+	fill_array(randoms, size);
+	pr_info("input buffer: start: %p size %lu", 
+		randoms, sizeof(element_t) * size);
+	return randoms;
+}
+
+// fills the array with the (seeded, so always the same) random keys
+void fill_array(element_t* randoms, size_t size) {
 	srandom(15);
-	int* randoms = RMALLOC(sizeof(element_t) * size);
 	for (size_t i = 0; i < size; i++) {
 #ifndef USE_VDSO_CHECKS
 		/* this results in a bug with vdso, not sure why. Corrupts stack so 
@@ -429,17 +780,15 @@ int* generate_array_of_size(size_t size) {
 		 * doesn't matter if we hint it */
 		HINT_WRITE_FAULT(&randoms[i]);
 #endif
-		randoms[i] = (element_t) random();
+		KEY(randoms[i]) = RANDOM_KEY();
+		SET_PAYLOAD(randoms[i]);
 	}
-	pr_info("input buffer: start: %p size %lu", 
-		randoms, sizeof(element_t) * size);
-	return randoms;
 }
 
 // prints the values of the given array
-void print_array(int* array, size_t size) {
+void print_array(element_t* array, size_t size) {
 	for (size_t i = 0; i < size; i++) {
-		printf("%d ", array[i]);
+		printf(KEY_FMT " ", KEY_PRINT(KEY(array[i])));
 	}
 	printf("\n");
 }
@@ -458,5 +807,9 @@ void checkpoint(char* name) {
 }
 
 // reference: https://stackoverflow.com/a/27284318/9985287
-// integer compare function
-int cmpfunc (const void * a, const void * b) { return ( *(int *) a - *(int*)b );}
+// key compare function. compares rather than subtracts: the difference
+// of two keys overflows
+int cmpfunc (const void * a, const void * b) { 
+	sort_key_t ka = KEY(*(element_t*) a), kb = KEY(*(element_t*) b);
+	return (ka > kb) - (ka < kb);
+}
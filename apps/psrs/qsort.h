@@ -2,9 +2,56 @@
 #define __QSORT_H__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
-typedef int qelement_t;
+/*
+ * sort records: a KEY_BITS (32 or 64) bit key, signed unless KEY_UNSIGNED,
+ * optionally followed by PAYLOAD_SIZE bytes that travel with it. the key 
+ * type is fixed at build time and everything compares keys through QKEY 
+ * directly, so no comparator function is ever called
+ */
+#ifndef KEY_BITS
+#define KEY_BITS 32
+#endif
+#ifndef PAYLOAD_SIZE
+#define PAYLOAD_SIZE 0
+#endif
+
+#if KEY_BITS == 32
+typedef uint32_t qukey_t;
+#ifdef KEY_UNSIGNED
+typedef uint32_t qkey_t;
+#else
+typedef int32_t qkey_t;
+#endif
+/* a type wider than any key, so one value above all keys is left over */
+typedef long long qwide_key_t;
+#define QWIDE_KEY_MAX   ((qwide_key_t) (~0ull >> 1))
+#elif KEY_BITS == 64
+typedef uint64_t qukey_t;
+#ifdef KEY_UNSIGNED
+typedef uint64_t qkey_t;
+#else
+typedef int64_t qkey_t;
+#endif
+typedef __int128 qwide_key_t;
+#define QWIDE_KEY_MAX   ((qwide_key_t) (~(unsigned __int128) 0 >> 1))
+#else
+#error "KEY_BITS must be 32 or 64"
+#endif
+
+#if PAYLOAD_SIZE > 0
+typedef struct {
+    qkey_t key;
+    char payload[PAYLOAD_SIZE];
+} qelement_t;
+#define QKEY(e)     ((e).key)
+#else
+typedef qkey_t qelement_t;
+#define QKEY(e)     (e)
+#endif
+
 void _qsort (void *b, size_t n, size_t s, __compar_fn_t cmp);
 
 #endif /* ifndef __QSORT_H__ */
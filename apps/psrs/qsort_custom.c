@@ -3,48 +3,90 @@
 
 unsigned long counter = 0;
 
+/*
+ * Introsort: quicksort with a median-of-3 (ninther for large ranges) 
+ * pivot, an explicit stack instead of recursion, heapsort once the 
+ * partitioning goes too deep and insertion sort for small ranges. 
+ * Worst case is O(n log n) time and O(log n) stack, which matters on
+ * small uthread stacks.
+ */
+
+#define INSERTION_THRESH    16      /* ranges this small are insertion sorted */
+#define NINTHER_THRESH      128     /* ranges this large take a ninther pivot */
+#define STACK_SIZE          (8 * sizeof(size_t))    /* >= log2(n) */
+
+#define SWAP(a, b)          { qelement_t aux = (a); (a) = (b); (b) = aux; }
+
+static inline size_t _med3(qelement_t *base, size_t a, size_t b, size_t c)
+{
+    return QKEY(base[a]) < QKEY(base[b]) ?
+        (QKEY(base[b]) < QKEY(base[c]) ? b : 
+            (QKEY(base[a]) < QKEY(base[c]) ? c : a)) :
+        (QKEY(base[b]) > QKEY(base[c]) ? b : 
+            (QKEY(base[a]) < QKEY(base[c]) ? a : c));
+}
+
+/* moves the pivot of base[l..r] to base[l] */
+static inline void _choose_pivot(qelement_t *base, size_t l, size_t r)
+{
+    size_t n = r - l + 1, m = l + n / 2, p;
+    if (n >= NINTHER_THRESH) {
+        size_t s = n / 8;
+        p = _med3(base, _med3(base, l, l + s, l + 2*s),
+                        _med3(base, m - s, m, m + s),
+                        _med3(base, r - 2*s, r - s, r));
+    } else {
+        p = _med3(base, l, m, r);
+    }
+    SWAP(base[l], base[p]);
+}
+
 /*
  * Quicksort partition function
  *
- * This will give the pivot position for the next iteration.
+ * This will give the pivot position for the next iteration. Both scans 
+ * stop on keys equal to the pivot, so runs of duplicates split evenly 
+ * instead of degrading to O(n^2).
  *
  */
 size_t _partition(qelement_t *base, size_t l, size_t r)
 {
     size_t i = l;             /* left approximation index */
     size_t j = r + 1;         /* right approximation index */
-    qelement_t pivot = base[l];
+    qelement_t pivot;
     qelement_t* addr;
 
-    while (i < j) {
+    _choose_pivot(base, l, r);
+    pivot = base[l];
+
+    while (1) {
         /* left-approx i to pivot */
         do { 
             ++i;
             addr = &base[i];
 #ifndef NO_QSORT_ANNOTS
-            if (((unsigned long)addr & _PAGE_OFFSET_MASK) == 0) {
+            if (i <= r && PAGE_FIRST(addr)) {
                 HINT_WRITE_FAULT_OPT_RDAHEAD_BLOCK(addr);
             }
 #endif
-        } while (*addr <= pivot && i <= r);
+        } while (i <= r && QKEY(*addr) < QKEY(pivot));
 
-        /* right-approx j to pivot */
+        /* right-approx j to pivot; stops at the pivot at l at the latest */
         do {
             --j;
             addr = &base[j];
 #ifndef NO_QSORT_ANNOTS
-            if (((unsigned long)addr & _PAGE_OFFSET_MASK) == (_PAGE_SIZE - sizeof(qelement_t))) {
+            if (PAGE_LAST(addr)) {
                 HINT_WRITE_FAULT_OPT_INVERSE_RDAHEAD_BLOCK(addr);
             }
 #endif
-        } while (*addr > pivot && j >= l);
+        } while (QKEY(*addr) > QKEY(pivot));
 
-        /* do swap if swap is possible */
-        if (i < j) {
-            qelement_t aux = base[i];
-            base[i] = base[j];
-            base[j] = aux;
-        }
+        if (i >= j)
+            break;
+
+        /* do swap */
+        SWAP(base[i], base[j]);
     }
 
     /* replace pivot */
@@ -53,25 +95,97 @@ size_t _partition(qelement_t *base, size_t l, size_t r)
     return j;
 }
 
+static void _insertion_sort(qelement_t *base, size_t l, size_t r)
+{
+    for (size_t i = l + 1; i <= r; i++) {
+        qelement_t v = base[i];
+        size_t j = i;
+        while (j > l && QKEY(base[j - 1]) > QKEY(v)) {
+            base[j] = base[j - 1];
+            j--;
+        }
+        base[j] = v;
+    }
+}
+
+static void _sift_down(qelement_t *base, size_t root, size_t n)
+{
+    size_t child;
+    qelement_t v = base[root];
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && QKEY(base[child + 1]) > QKEY(base[child]))
+            child++;
+        if (QKEY(base[child]) <= QKEY(v))
+            break;
+        base[root] = base[child];
+        root = child;
+    }
+    base[root] = v;
+}
+
+static void _heapsort(qelement_t *base, size_t n)
+{
+    for (size_t i = n / 2; i-- > 0; )
+        _sift_down(base, i, n);
+    for (size_t i = n - 1; i > 0; i--) {
+        SWAP(base[0], base[i]);
+        _sift_down(base, 0, i);
+    }
+}
+
 /*
  * Quicksort entry point function
  *
- * The sorting for base is done in-place.
+ * The sorting for base is done in-place. The smaller side of each 
+ * partition is sorted first and the larger one is deferred on the 
+ * stack, which bounds the stack to log2(n) entries; a range that has 
+ * been partitioned 2*log2(n) times is handed to heapsort.
  *
  */
-void _quicksort(qelement_t *base, size_t l, size_t r)
+void _quicksort(qelement_t *base, size_t n)
 {
-    if (l >= r)
-        return;
+    struct { size_t l, r; int depth; } stack[STACK_SIZE];
+    int top = 0, depth = 0;
+    size_t l = 0, r, j;
 
-    size_t j = _partition(base, l, r);  /* pivot position */
-    _quicksort(base, j + 1, r);         /* right chunk */
-    if (j > 0)  
-        _quicksort(base, l, j - 1);     /* left chunk */
+    if (n < 2)
+        return;
+    for (r = n; r > 1; r >>= 1)
+        depth += 2;
+    r = n - 1;
 
+    while (1) {
+        if (r - l + 1 <= INSERTION_THRESH) {
+            _insertion_sort(base, l, r);
+        } else if (depth == 0) {
+            _heapsort(base + l, r - l + 1);
+        } else {
+            j = _partition(base, l, r);     /* pivot position */
+            depth--;
+            if (j - l < r - j) {
+                /* left chunk first, right later */
+                stack[top].l = j + 1; stack[top].r = r; 
+                stack[top++].depth = depth;
+                if (j > l) { r = j - 1; continue; }
+            } else {
+                /* right chunk first, left later */
+                if (j > l) {
+                    stack[top].l = l; stack[top].r = j - 1; 
+                    stack[top++].depth = depth;
+                }
+                if (j < r) { l = j + 1; continue; }
+            }
+        }
+        if (top == 0)
+            break;
+        top--;
+        l = stack[top].l;
+        r = stack[top].r;
+        depth = stack[top].depth;
+    }
 }
 
 void _qsort (void *base, size_t size, size_t s, __compar_fn_t cmp) {
     assert(s == sizeof(qelement_t));
-    _quicksort(base, 0, size - 1);
+    _quicksort(base, size);
 }
@@ -0,0 +1,125 @@
+#include "common.h"
+#include "radixsort.h"
+
+/*
+ * LSD radix sort for the keys of phase 1, moving whole records
+ *
+ * Each pass reads its source sequentially and scatters into the other 
+ * buffer, ping-ponging between base and tmp. Scattered writes go 
+ * through a small per-bucket write-combining buffer that is flushed a 
+ * cache line at a time, so the destination is written as 2^RADIX_BITS 
+ * sequential streams instead of one random store per key. Both sides 
+ * are hinted once per page crossing.
+ */
+
+#define RADIX_BUCKETS   (1 << RADIX_BITS)
+#define RADIX_MASK      (RADIX_BUCKETS - 1)
+#define RADIX_PASSES    ((KEY_BITS + RADIX_BITS - 1) / RADIX_BITS)
+#define WC_ELEMS        (sizeof(qelement_t) < CACHE_LINE_SIZE ? \
+                            CACHE_LINE_SIZE / sizeof(qelement_t) : 1)
+
+/* flip the sign bit so signed keys sort as unsigned */
+static inline qukey_t radix_key(qelement_t v) {
+#ifdef KEY_UNSIGNED
+    return (qukey_t) QKEY(v);
+#else
+    return (qukey_t) QKEY(v) ^ ((qukey_t) 1 << (KEY_BITS - 1));
+#endif
+}
+
+static inline unsigned int radix_digit(qelement_t v, int pass) {
+    return (radix_key(v) >> (pass * RADIX_BITS)) & RADIX_MASK;
+}
+
+/* write out a combined line at dst[pos], hinting on a new page */
+static inline void wc_flush(qelement_t* dst, size_t pos, 
+        qelement_t* line, size_t len)
+{
+    qelement_t* addr = &dst[pos];
+    unsigned long first = (unsigned long) addr & _PAGE_MASK;
+    unsigned long last = ((unsigned long) (addr + len) - 1) & _PAGE_MASK;
+    if (first != last || PAGE_FIRST(addr))
+        HINT_WRITE_FAULT_OPT_RDAHEAD((void*) last);
+    memcpy(addr, line, len * sizeof(qelement_t));
+}
+
+void _radixsort(qelement_t* base, qelement_t* tmp, size_t n)
+{
+    size_t (*count)[RADIX_BUCKETS];
+    size_t* pos;
+    unsigned char* fill;
+    qelement_t* wc;
+    qelement_t *src = base, *dst = tmp, *swap;
+    size_t i, sum, c;
+    unsigned int d;
+    int p, b, skip;
+
+    if (n < 2)
+        return;
+
+    count = calloc(RADIX_PASSES, sizeof(*count));
+    pos = malloc(RADIX_BUCKETS * sizeof(size_t));
+    fill = malloc(RADIX_BUCKETS);
+    wc = aligned_alloc(CACHE_LINE_SIZE, 
+        RADIX_BUCKETS * WC_ELEMS * sizeof(qelement_t));
+    assert(count && pos && fill && wc);
+
+    /* one sequential read computes the histograms of all passes */
+    for (i = 0; i < n; i++) {
+        if (PAGE_FIRST(&src[i]))
+            HINT_READ_FAULT_OPT_RDAHEAD(&src[i]);
+        for (p = 0; p < RADIX_PASSES; p++)
+            count[p][radix_digit(src[i], p)]++;
+    }
+
+    for (p = 0; p < RADIX_PASSES; p++) {
+        /* all keys share this digit: the pass would be a plain copy */
+        skip = 0;
+        for (b = 0; b < RADIX_BUCKETS; b++)
+            if (count[p][b] == n)
+                skip = 1;
+        if (skip)
+            continue;
+
+        for (sum = 0, b = 0; b < RADIX_BUCKETS; b++) {
+            pos[b] = sum;
+            sum += count[p][b];
+            fill[b] = 0;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (PAGE_FIRST(&src[i]))
+                HINT_READ_FAULT_OPT_RDAHEAD(&src[i]);
+            d = radix_digit(src[i], p);
+            wc[d * WC_ELEMS + fill[d]++] = src[i];
+            /* a bucket's first line only runs up to the next line 
+             * boundary in dst, so later flushes are line-aligned */
+            c = WC_ELEMS - (((unsigned long)&dst[pos[d]] 
+                % CACHE_LINE_SIZE) / sizeof(qelement_t));
+            if (c == 0)
+                c = 1;
+            if (fill[d] == c) {
+                wc_flush(dst, pos[d], &wc[d * WC_ELEMS], c);
+                pos[d] += c;
+                fill[d] = 0;
+            }
+        }
+        for (b = 0; b < RADIX_BUCKETS; b++) {
+            if (fill[b]) {
+                wc_flush(dst, pos[b], &wc[b * WC_ELEMS], fill[b]);
+                pos[b] += fill[b];
+            }
+        }
+
+        swap = src; src = dst; dst = swap;
+    }
+
+    /* odd number of passes: the result is in tmp */
+    if (src != base)
+        memcpy(base, src, n * sizeof(qelement_t));
+
+    free(count);
+    free(pos);
+    free(fill);
+    free(wc);
+}
@@ -0,0 +1,14 @@
+#ifndef __RADIXSORT_H__
+#define __RADIXSORT_H__
+
+#include <stddef.h>
+#include "qsort.h"
+
+/* digit width of the LSD radix sort: 8 (four passes) or 11 (three) */
+#ifndef RADIX_BITS
+#define RADIX_BITS 8
+#endif
+
+void _radixsort(qelement_t* base, qelement_t* tmp, size_t n);
+
+#endif /* ifndef __RADIXSORT_H__ */
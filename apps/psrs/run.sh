@@ -14,6 +14,13 @@ usage="Example: bash run.sh\n
 -e, --eden \t run with Eden's remote memory\n
 -h, --hints \t enable Eden's remote memory hints\n
 -fs, --fastswap \t enable remote memory with fastswap\n
+-ls, --localsort \t phase 1 sort engine: quick (default) or radix\n
+-kb, --keybits \t key width: 32 (default) or 64 bits\n
+-uk, --unsigned \t unsigned keys\n
+-pl, --payload \t bytes of payload sorted along with each key (defaults to 0)\n
+-nu, --numa \t\t pin workers across numa nodes and first-touch their chunks\n
+-ex, --external \t out-of-core sort with runs of this many keys, spilled to disk\n
+-os, --oversample \t regular samples per thread, in multiples of threads (defaults to 1)\n
 -fl,--cflags \t\t C flags passed to gcc when compiling the app/test\n
 -c, --cores \t\t number of CPU cores (defaults to 1)\n
 -t, --threads \t\t number of worker threads (defaults to --cores)\n
@@ -214,6 +221,43 @@ case $i in
     MERGE_RDAHEAD=${i#*=}
     ;;
 
+    -ls=*|--localsort=*)
+    LOCALSORT=${i#*=}
+    if [[ "$LOCALSORT" == "radix" ]]; then
+        CFLAGS="$CFLAGS -DRADIX_SORT"
+    fi
+    ;;
+
+    -kb=*|--keybits=*)
+    KEYBITS=${i#*=}
+    CFLAGS="$CFLAGS -DKEY_BITS=$KEYBITS"
+    ;;
+
+    -uk|--unsigned)
+    UNSIGNED_KEYS=1
+    CFLAGS="$CFLAGS -DKEY_UNSIGNED"
+    ;;
+
+    -pl=*|--payload=*)
+    PAYLOAD=${i#*=}
+    CFLAGS="$CFLAGS -DPAYLOAD_SIZE=$PAYLOAD"
+    ;;
+
+    -nu|--numa)
+    NUMA_PLACEMENT=1
+    CFLAGS="$CFLAGS -DNUMA_PLACEMENT"
+    ;;
+
+    -ex=*|--external=*)
+    EXT_RUN_KEYS=${i#*=}
+    CFLAGS="$CFLAGS -DEXTERNAL_SORT"
+    ;;
+
+    -os=*|--oversample=*)
+    OVERSAMPLE=${i#*=}
+    CFLAGS="$CFLAGS -DOVERSAMPLE=$OVERSAMPLE"
+    ;;
+
     -sf|--safemode)
     SAFEMODE=1
     ;;
@@ -453,9 +497,9 @@ if [[ $SHENANGO ]]; then
 fi
 
 # compile
-LIBS="${LIBS} -lpthread -lm"
+LIBS="${LIBS} -lpthread -lm -lrt"     # -lrt: posix aio in extsort.c
 CFLAGS="$CFLAGS -DMERGE_RDAHEAD=$MERGE_RDAHEAD"
-gcc main.c qsort_custom.c -D_GNU_SOURCE -Wall -O ${INC} ${LIBS} ${CFLAGS} ${LDFLAGS} -o ${BINFILE}
+gcc main.c qsort_custom.c radixsort.c extsort.c topology.c -D_GNU_SOURCE -Wall -O ${INC} ${LIBS} ${CFLAGS} ${LDFLAGS} -o ${BINFILE}
 
 if [[ $BUILD_ONLY ]]; then
     exit 0
@@ -478,6 +522,13 @@ save_cfg "localmem"     $LMEM
 save_cfg "lmemper"      $LMEMPER
 save_cfg "rdahead"      $RDAHEAD
 save_cfg "mergerdahead" $MERGE_RDAHEAD
+save_cfg "localsort"    $LOCALSORT
+save_cfg "oversample"   $OVERSAMPLE
+save_cfg "extrunkeys"   $EXT_RUN_KEYS
+save_cfg "keybits"      $KEYBITS
+save_cfg "unsigned"     $UNSIGNED_KEYS
+save_cfg "payload"      $PAYLOAD
+save_cfg "numa"         $NUMA_PLACEMENT
 save_cfg "evictbatch"   $EVICT_BATCH_SIZE
 save_cfg "evictpolicy"  $EVICT_POLICY
 save_cfg "evictgens"    $EVICT_GENS
@@ -612,8 +663,14 @@ for retry in 1; do
 
     # run
     args="${NKEYS} ${NTHREADS}"
+    if [[ $EXT_RUN_KEYS ]]; then
+        args="${args} ${EXT_RUN_KEYS} ${PWD}/spill"
+    fi
     echo sudo ${wrapper} ${BINFILE} ${args} 
-    nohup sudo ${wrapper} numactl -m ${NUMA_NODE} ${BINFILE} ${args} 2>&1 | tee app.out &
+    # with --numa, first-touch decides where pages go, not a memory bind
+    numa_opts="-m ${NUMA_NODE}"
+    if [[ $NUMA_PLACEMENT ]]; then  numa_opts="--localalloc";   fi
+    nohup sudo ${wrapper} numactl ${numa_opts} ${BINFILE} ${args} 2>&1 | tee app.out &
 
     # wait for run to finish
     tries=0
@@ -642,6 +699,8 @@ for retry in 1; do
                 break
             fi
         done
+        # the sorted output of an external sort is not kept
+        sudo rm -f spill.runs spill.sorted
         popd
 
         # if we're here, the run has mostly succeeded
@@ -0,0 +1,124 @@
+#include <dirent.h>
+#include <sched.h>
+
+#include "common.h"
+#include "topology.h"
+
+#define SYSFS_CPU   "/sys/devices/system/cpu"
+#define MAX_CPUS    1024
+#define MAX_NODES   64
+
+static int nnodes;
+static int node_of[MAX_CPUS];
+static int node_cpus[MAX_NODES][MAX_CPUS];  /* cores first, then siblings */
+static int node_ncpus[MAX_NODES];
+
+/* reads the first integer in a sysfs file, -1 if there is none */
+static int read_int(const char* path) {
+	FILE* fp = fopen(path, "r");
+	int v = -1;
+	if (fp) {
+		if (fscanf(fp, "%d", &v) != 1)
+			v = -1;
+		fclose(fp);
+	}
+	return v;
+}
+
+/* numa node of a cpu from its nodeN link; 0 without numa support */
+static int read_node(int cpu) {
+	char path[128];
+	struct dirent* d;
+	DIR* dir;
+	int node = 0;
+
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while ((d = readdir(dir)))
+		if (sscanf(d->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return node < MAX_NODES ? node : 0;
+}
+
+int topo_init(void) {
+	char path[128];
+	cpu_set_t allowed;
+	int cpu, node, pass, first, ncpus = 0;
+
+	/* only the cpus we are allowed to run on (taskset, cgroups) */
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		perror("sched_getaffinity");
+		return -1;
+	}
+
+	nnodes = 0;
+	memset(node_ncpus, 0, sizeof(node_ncpus));
+	for (cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+		node_of[cpu] = -1;
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		node_of[cpu] = read_node(cpu);
+		if (node_of[cpu] + 1 > nnodes)
+			nnodes = node_of[cpu] + 1;
+	}
+
+	/* first pass: the first hyperthread of each core; second: the rest */
+	for (pass = 0; pass < 2; pass++) {
+		for (cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+			if (node_of[cpu] < 0)
+				continue;
+			snprintf(path, sizeof(path), 
+				SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+			first = read_int(path);
+			if ((pass == 0) != (first < 0 || first == cpu))
+				continue;
+			node = node_of[cpu];
+			node_cpus[node][node_ncpus[node]++] = cpu;
+			ncpus++;
+		}
+	}
+
+	/* drop nodes without (allowed) cpus */
+	for (node = 0; node < nnodes; ) {
+		if (node_ncpus[node] == 0) {
+			memmove(&node_cpus[node], &node_cpus[node + 1], 
+				(nnodes - node - 1) * sizeof(node_cpus[0]));
+			memmove(&node_ncpus[node], &node_ncpus[node + 1], 
+				(nnodes - node - 1) * sizeof(node_ncpus[0]));
+			nnodes--;
+		} else {
+			node++;
+		}
+	}
+	pr_info("topology: %d cpus on %d numa nodes", ncpus, nnodes);
+	return ncpus > 0 ? 0 : -1;
+}
+
+int topo_cpu_for(int worker, int nworkers) {
+	int node = (long) worker * nnodes / nworkers;
+	/* index of the worker among those placed on its node */
+	int first = (node * nworkers + nnodes - 1) / nnodes;
+	return node_cpus[node][(worker - first) % node_ncpus[node]];
+}
+
+int topo_node_of(int cpu) {
+	return node_of[cpu];
+}
+
+/* pins the calling thread to worker's cpu */
+int topo_pin(int worker, int nworkers) {
+	cpu_set_t cpuset;
+	int ret, cpu = topo_cpu_for(worker, nworkers);
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+	if (ret) {
+		errno = ret;
+		perror("pthread_setaffinity_np");
+	}
+	return ret;
+}
@@ -0,0 +1,17 @@
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+/*
+ * cpu/numa topology from sysfs, for placing workers: worker i of n gets 
+ * a cpu on node (i * nnodes / n), so that each node takes a contiguous 
+ * block of workers (and, with first-touch, of the array). within a 
+ * node, one hardware thread per physical core is used before any 
+ * hyperthread siblings
+ */
+
+int topo_init(void);
+int topo_cpu_for(int worker, int nworkers);
+int topo_node_of(int cpu);
+int topo_pin(int worker, int nworkers);
+
+#endif /* ifndef __TOPOLOGY_H__ */
@@ -130,10 +130,10 @@ if [[ $FORCE ]]; then
 fi
 
 # compile
-LIBS="${LIBS} -lpthread -lm"
+LIBS="${LIBS} -lpthread -lm -lrt"     # -lrt: posix aio in extsort.c
 CFLAGS="$CFLAGS -DMERGE_RDAHEAD=$MERGE_RDAHEAD"
 CFLAGS="$CFLAGS -g -no-pie -fno-pie"
-gcc main.c qsort_custom.c -D_GNU_SOURCE -Wall -O ${INC} ${LIBS} ${CFLAGS} ${LDFLAGS} -o ${BINFILE}
+gcc main.c qsort_custom.c radixsort.c extsort.c topology.c -D_GNU_SOURCE -Wall -O ${INC} ${LIBS} ${CFLAGS} ${LDFLAGS} -o ${BINFILE}
 
 # initialize run
 expdir=$EXPNAME
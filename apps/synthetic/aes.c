@@ -17,8 +17,13 @@
 
 /*************************** HEADER FILES ***************************/
 #include <stdlib.h>
+#include <stdint.h>
 #include <memory.h>
 #include "aes.h"
+#if defined(__x86_64__) && !defined(AES_NO_NI)
+#include <immintrin.h>
+#define AES_NI
+#endif
 
 #include <stdio.h>
 
@@ -39,6 +44,11 @@ void ccm_prepare_first_ctr_blk(BYTE counter[], const BYTE nonce[], int nonce_len
 void ccm_prepare_first_format_blk(BYTE buf[], int assoc_len, int payload_len, int payload_len_store_size, int mac_len, const BYTE nonce[], int nonce_len);
 void ccm_format_assoc_data(BYTE buf[], int *end_of_buf, const BYTE assoc[], int assoc_len);
 void ccm_format_payload_data(BYTE buf[], int *end_of_buf, const BYTE payload[], int payload_len);
+static int aes_encrypt_cbc_sw(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[]);
+static int aes_decrypt_cbc_sw(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[]);
+static void aes_encrypt_ctr_sw(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[]);
+static void aes_encrypt_ctr_multi_sw(const BYTE *in[], const size_t in_len[], BYTE *out[], int nbufs,
+                                     const WORD key[], int keysize, const BYTE *iv[]);
 
 /**************************** VARIABLES *****************************/
 // This is the specified AES SBox. To look up a substitution value, put the first
@@ -228,10 +238,390 @@ void xor_buf(const BYTE in[], BYTE out[], size_t len)
 		out[idx] ^= in[idx];
 }
 
+/*******************
+* AES - NI
+*******************/
+// Hardware paths for CBC and CTR. They use the same key schedule as the
+// portable code (aes_key_setup), byte-swapping each round key as it is
+// loaded, so callers need not know which implementation runs.
+#define AES_IMPL_SW    0
+#define AES_IMPL_NI    1                // AES-NI, one block per instruction
+#define AES_IMPL_VAES  2                // VAES + AVX2, two blocks per instruction
+
+#ifdef AES_NI
+// Picks the implementation from CPUID on first use.
+static int aes_impl(void)
+{
+	static int impl = -1;
+
+	if (impl < 0) {
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("aes") || !__builtin_cpu_supports("ssse3"))
+			impl = AES_IMPL_SW;
+		else if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx2"))
+			impl = AES_IMPL_VAES;
+		else
+			impl = AES_IMPL_NI;
+	}
+	return(impl);
+}
+
+#define AES_NI_TARGET   __attribute__((target("aes,ssse3")))
+#define AES_VAES_TARGET __attribute__((target("aes,ssse3,vaes,avx2")))
+
+static inline int aes_ni_rounds(int keysize)
+{
+	return(keysize == 128 ? AES_128_ROUNDS : keysize == 192 ? AES_192_ROUNDS : AES_256_ROUNDS);
+}
+
+// Loads the key schedule as AES-NI round keys. The words in "key" hold the
+// bytes big-endian, so each 32-bit lane is byte-reversed.
+AES_NI_TARGET static inline void aes_ni_load_keys(const WORD key[], int nr, __m128i rk[])
+{
+	const __m128i bswap = _mm_set_epi8(12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+	int idx;
+
+	for (idx = 0; idx <= nr; idx++)
+		rk[idx] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&key[4 * idx]), bswap);
+}
+
+// Round keys for the equivalent inverse cipher, in the order they are used.
+AES_NI_TARGET static inline void aes_ni_dec_keys(const __m128i rk[], int nr, __m128i dk[])
+{
+	int idx;
+
+	dk[0] = rk[nr];
+	for (idx = 1; idx < nr; idx++)
+		dk[idx] = _mm_aesimc_si128(rk[nr - idx]);
+	dk[nr] = rk[0];
+}
+
+AES_NI_TARGET static inline __m128i aes_ni_encrypt_block(__m128i b, const __m128i rk[], int nr)
+{
+	int idx;
+
+	b = _mm_xor_si128(b, rk[0]);
+	for (idx = 1; idx < nr; idx++)
+		b = _mm_aesenc_si128(b, rk[idx]);
+	return(_mm_aesenclast_si128(b, rk[nr]));
+}
+
+AES_NI_TARGET static inline __m128i aes_ni_decrypt_block(__m128i b, const __m128i dk[], int nr)
+{
+	int idx;
+
+	b = _mm_xor_si128(b, dk[0]);
+	for (idx = 1; idx < nr; idx++)
+		b = _mm_aesdec_si128(b, dk[idx]);
+	return(_mm_aesdeclast_si128(b, dk[nr]));
+}
+
+// The CTR counter is the whole 16-byte IV, big-endian (as increment_iv()
+// with counter_size = AES_BLOCK_SIZE). Kept as two native halves.
+struct aes_ni_ctr {
+	uint64_t hi, lo;
+};
+
+static inline void aes_ni_ctr_init(struct aes_ni_ctr *ctr, const BYTE iv[])
+{
+	memcpy(&ctr->hi, iv, 8);
+	memcpy(&ctr->lo, iv + 8, 8);
+	ctr->hi = __builtin_bswap64(ctr->hi);
+	ctr->lo = __builtin_bswap64(ctr->lo);
+}
+
+// Returns the current counter block and advances the counter.
+AES_NI_TARGET static inline __m128i aes_ni_ctr_next(struct aes_ni_ctr *ctr)
+{
+	__m128i b = _mm_set_epi64x(__builtin_bswap64(ctr->lo), __builtin_bswap64(ctr->hi));
+
+	if (++ctr->lo == 0)
+		ctr->hi++;
+	return(b);
+}
+
+AES_NI_TARGET static int aes_encrypt_cbc_ni(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
+{
+	__m128i rk[AES_256_ROUNDS + 1], b;
+	int nr = aes_ni_rounds(keysize);
+	size_t idx;
+
+	if (in_len % AES_BLOCK_SIZE != 0)
+		return(FALSE);
+
+	// Each block depends on the last, so this is bound by the aesenc latency.
+	aes_ni_load_keys(key, nr, rk);
+	b = _mm_loadu_si128((const __m128i *)iv);
+	for (idx = 0; idx < in_len; idx += AES_BLOCK_SIZE) {
+		b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)&in[idx]));
+		b = aes_ni_encrypt_block(b, rk, nr);
+		_mm_storeu_si128((__m128i *)&out[idx], b);
+	}
+
+	return(TRUE);
+}
+
+AES_NI_TARGET static int aes_decrypt_cbc_ni(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
+{
+	__m128i rk[AES_256_ROUNDS + 1], dk[AES_256_ROUNDS + 1];
+	__m128i prev, c0, c1, c2, c3, b0, b1, b2, b3;
+	int nr = aes_ni_rounds(keysize), r;
+	size_t idx;
+
+	if (in_len % AES_BLOCK_SIZE != 0)
+		return(FALSE);
+
+	aes_ni_load_keys(key, nr, rk);
+	aes_ni_dec_keys(rk, nr, dk);
+	prev = _mm_loadu_si128((const __m128i *)iv);
+
+	// Decryption is parallel: four blocks in flight hide the aesdec latency.
+	for (idx = 0; idx + 4 * AES_BLOCK_SIZE <= in_len; idx += 4 * AES_BLOCK_SIZE) {
+		c0 = _mm_loadu_si128((const __m128i *)&in[idx]);
+		c1 = _mm_loadu_si128((const __m128i *)&in[idx + 16]);
+		c2 = _mm_loadu_si128((const __m128i *)&in[idx + 32]);
+		c3 = _mm_loadu_si128((const __m128i *)&in[idx + 48]);
+		b0 = _mm_xor_si128(c0, dk[0]);
+		b1 = _mm_xor_si128(c1, dk[0]);
+		b2 = _mm_xor_si128(c2, dk[0]);
+		b3 = _mm_xor_si128(c3, dk[0]);
+		for (r = 1; r < nr; r++) {
+			b0 = _mm_aesdec_si128(b0, dk[r]);
+			b1 = _mm_aesdec_si128(b1, dk[r]);
+			b2 = _mm_aesdec_si128(b2, dk[r]);
+			b3 = _mm_aesdec_si128(b3, dk[r]);
+		}
+		b0 = _mm_xor_si128(_mm_aesdeclast_si128(b0, dk[nr]), prev);
+		b1 = _mm_xor_si128(_mm_aesdeclast_si128(b1, dk[nr]), c0);
+		b2 = _mm_xor_si128(_mm_aesdeclast_si128(b2, dk[nr]), c1);
+		b3 = _mm_xor_si128(_mm_aesdeclast_si128(b3, dk[nr]), c2);
+		_mm_storeu_si128((__m128i *)&out[idx], b0);
+		_mm_storeu_si128((__m128i *)&out[idx + 16], b1);
+		_mm_storeu_si128((__m128i *)&out[idx + 32], b2);
+		_mm_storeu_si128((__m128i *)&out[idx + 48], b3);
+		prev = c3;
+	}
+	for (; idx < in_len; idx += AES_BLOCK_SIZE) {
+		c0 = _mm_loadu_si128((const __m128i *)&in[idx]);
+		b0 = _mm_xor_si128(aes_ni_decrypt_block(c0, dk, nr), prev);
+		_mm_storeu_si128((__m128i *)&out[idx], b0);
+		prev = c0;
+	}
+
+	return(TRUE);
+}
+
+// Encrypts "len" bytes at "idx" onwards with AES-NI, four blocks at a time,
+// the last block possibly partial. The counter is left past the last block.
+AES_NI_TARGET static inline void aes_ni_ctr_xor(const BYTE in[], size_t len, BYTE out[],
+                                                const __m128i rk[], int nr, struct aes_ni_ctr *ctr)
+{
+	__m128i b0, b1, b2, b3;
+	BYTE last[AES_BLOCK_SIZE];
+	size_t idx;
+	int r;
+
+	for (idx = 0; idx + 4 * AES_BLOCK_SIZE <= len; idx += 4 * AES_BLOCK_SIZE) {
+		b0 = _mm_xor_si128(aes_ni_ctr_next(ctr), rk[0]);
+		b1 = _mm_xor_si128(aes_ni_ctr_next(ctr), rk[0]);
+		b2 = _mm_xor_si128(aes_ni_ctr_next(ctr), rk[0]);
+		b3 = _mm_xor_si128(aes_ni_ctr_next(ctr), rk[0]);
+		for (r = 1; r < nr; r++) {
+			b0 = _mm_aesenc_si128(b0, rk[r]);
+			b1 = _mm_aesenc_si128(b1, rk[r]);
+			b2 = _mm_aesenc_si128(b2, rk[r]);
+			b3 = _mm_aesenc_si128(b3, rk[r]);
+		}
+		b0 = _mm_xor_si128(_mm_aesenclast_si128(b0, rk[nr]), _mm_loadu_si128((const __m128i *)&in[idx]));
+		b1 = _mm_xor_si128(_mm_aesenclast_si128(b1, rk[nr]), _mm_loadu_si128((const __m128i *)&in[idx + 16]));
+		b2 = _mm_xor_si128(_mm_aesenclast_si128(b2, rk[nr]), _mm_loadu_si128((const __m128i *)&in[idx + 32]));
+		b3 = _mm_xor_si128(_mm_aesenclast_si128(b3, rk[nr]), _mm_loadu_si128((const __m128i *)&in[idx + 48]));
+		_mm_storeu_si128((__m128i *)&out[idx], b0);
+		_mm_storeu_si128((__m128i *)&out[idx + 16], b1);
+		_mm_storeu_si128((__m128i *)&out[idx + 32], b2);
+		_mm_storeu_si128((__m128i *)&out[idx + 48], b3);
+	}
+	for (; idx + AES_BLOCK_SIZE <= len; idx += AES_BLOCK_SIZE) {
+		b0 = aes_ni_encrypt_block(aes_ni_ctr_next(ctr), rk, nr);
+		b0 = _mm_xor_si128(b0, _mm_loadu_si128((const __m128i *)&in[idx]));
+		_mm_storeu_si128((__m128i *)&out[idx], b0);
+	}
+	if (idx < len) {
+		_mm_storeu_si128((__m128i *)last, aes_ni_encrypt_block(aes_ni_ctr_next(ctr), rk, nr));
+		for (r = 0; idx + r < len; r++)
+			out[idx + r] = in[idx + r] ^ last[r];
+	}
+}
+
+AES_NI_TARGET static void aes_encrypt_ctr_ni(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
+{
+	__m128i rk[AES_256_ROUNDS + 1];
+	struct aes_ni_ctr ctr;
+	int nr = aes_ni_rounds(keysize);
+
+	aes_ni_load_keys(key, nr, rk);
+	aes_ni_ctr_init(&ctr, iv);
+	aes_ni_ctr_xor(in, in_len, out, rk, nr, &ctr);
+}
+
+// The next two counter blocks, the first one in the low lane.
+AES_VAES_TARGET static inline __m256i aes_vaes_ctr_next2(struct aes_ni_ctr *ctr)
+{
+	__m128i lo = aes_ni_ctr_next(ctr);
+
+	return(_mm256_set_m128i(aes_ni_ctr_next(ctr), lo));
+}
+
+// Same as above with VAES: each instruction works on two counter blocks, and
+// eight are in flight.
+AES_VAES_TARGET static void aes_encrypt_ctr_vaes(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
+{
+	__m128i rk[AES_256_ROUNDS + 1];
+	__m256i yk[AES_256_ROUNDS + 1], b0, b1, b2, b3;
+	struct aes_ni_ctr ctr;
+	int nr = aes_ni_rounds(keysize), r;
+	size_t idx;
+
+	aes_ni_load_keys(key, nr, rk);
+	for (r = 0; r <= nr; r++)
+		yk[r] = _mm256_broadcastsi128_si256(rk[r]);
+	aes_ni_ctr_init(&ctr, iv);
+
+	for (idx = 0; idx + 8 * AES_BLOCK_SIZE <= in_len; idx += 8 * AES_BLOCK_SIZE) {
+		b0 = _mm256_xor_si256(aes_vaes_ctr_next2(&ctr), yk[0]);
+		b1 = _mm256_xor_si256(aes_vaes_ctr_next2(&ctr), yk[0]);
+		b2 = _mm256_xor_si256(aes_vaes_ctr_next2(&ctr), yk[0]);
+		b3 = _mm256_xor_si256(aes_vaes_ctr_next2(&ctr), yk[0]);
+		for (r = 1; r < nr; r++) {
+			b0 = _mm256_aesenc_epi128(b0, yk[r]);
+			b1 = _mm256_aesenc_epi128(b1, yk[r]);
+			b2 = _mm256_aesenc_epi128(b2, yk[r]);
+			b3 = _mm256_aesenc_epi128(b3, yk[r]);
+		}
+		b0 = _mm256_xor_si256(_mm256_aesenclast_epi128(b0, yk[nr]), _mm256_loadu_si256((const __m256i *)&in[idx]));
+		b1 = _mm256_xor_si256(_mm256_aesenclast_epi128(b1, yk[nr]), _mm256_loadu_si256((const __m256i *)&in[idx + 32]));
+		b2 = _mm256_xor_si256(_mm256_aesenclast_epi128(b2, yk[nr]), _mm256_loadu_si256((const __m256i *)&in[idx + 64]));
+		b3 = _mm256_xor_si256(_mm256_aesenclast_epi128(b3, yk[nr]), _mm256_loadu_si256((const __m256i *)&in[idx + 96]));
+		_mm256_storeu_si256((__m256i *)&out[idx], b0);
+		_mm256_storeu_si256((__m256i *)&out[idx + 32], b1);
+		_mm256_storeu_si256((__m256i *)&out[idx + 64], b2);
+		_mm256_storeu_si256((__m256i *)&out[idx + 96], b3);
+	}
+	aes_ni_ctr_xor(&in[idx], in_len - idx, &out[idx], rk, nr, &ctr);
+}
+
+// Advances a counter by n blocks.
+static inline void aes_ni_ctr_add(struct aes_ni_ctr *ctr, uint64_t n)
+{
+	ctr->lo += n;
+	if (ctr->lo < n)
+		ctr->hi++;
+}
+
+// Multi-buffer CTR: AES_MB_LANES pipeline lanes are dealt out to the buffers
+// round-robin (buffer b gets lanes b, b + nbufs, ...) and each lane walks its
+// buffer with a stride of that buffer's lane count, so every iteration keeps
+// the same number of independent blocks in flight whatever the number of
+// buffers. Lane counters are kept as native 64-bit halves in a vector and
+// byte-reversed into counter blocks, which holds as long as no low half
+// wraps; buffers are done one at a time otherwise, and once the shortest
+// one runs out.
+#ifndef AES_MB_LANES
+#define AES_MB_LANES 8
+#endif
+// aes_ctr_test also runs the pipeline with 4 lanes
+#define AES_MB_MAX_LANES (AES_MB_LANES > 4 ? AES_MB_LANES : 4)
+
+// The pipeline for nlanes lanes, inlined into its callers with a constant
+// lane count so that the lane loops unroll.
+AES_NI_TARGET static inline __attribute__((always_inline))
+void aes_ctr_multi_ni_lanes(const BYTE *in[], const size_t in_len[], BYTE *out[], int nbufs,
+                            const WORD key[], int keysize, const BYTE *iv[], int nlanes)
+{
+	const __m128i bswap128 = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+	__m128i rk[AES_256_ROUNDS + 1], b[AES_MB_MAX_LANES], ctr[AES_MB_MAX_LANES], step[AES_MB_MAX_LANES];
+	struct aes_ni_ctr base[AES_CTR_MAX_BUFFERS];
+	const BYTE *lin[AES_MB_MAX_LANES];
+	BYTE *lout[AES_MB_MAX_LANES];
+	size_t iters, stride[AES_MB_MAX_LANES], done, it;
+	int nr = aes_ni_rounds(keysize), lanes[AES_CTR_MAX_BUFFERS], idx, r;
+
+	// with more buffers than lanes, some would get none
+	iters = nbufs > nlanes ? 0 : SIZE_MAX;
+	aes_ni_load_keys(key, nr, rk);
+	for (idx = 0; idx < nbufs; idx++) {
+		aes_ni_ctr_init(&base[idx], iv[idx]);
+		lanes[idx] = nlanes / nbufs + (idx < nlanes % nbufs);
+		if (iters > 0 && in_len[idx] / AES_BLOCK_SIZE / lanes[idx] < iters)
+			iters = in_len[idx] / AES_BLOCK_SIZE / lanes[idx];
+		if (base[idx].lo + in_len[idx] / AES_BLOCK_SIZE < base[idx].lo)
+			iters = 0;
+	}
+
+	if (iters > 0) {
+		for (idx = 0; idx < nlanes; idx++) {
+			int buf = idx % nbufs, rank = idx / nbufs;
+			ctr[idx] = _mm_set_epi64x(base[buf].hi, base[buf].lo + rank);
+			step[idx] = _mm_set_epi64x(0, lanes[buf]);
+			lin[idx] = in[buf] + rank * AES_BLOCK_SIZE;
+			lout[idx] = out[buf] + rank * AES_BLOCK_SIZE;
+			stride[idx] = lanes[buf] * AES_BLOCK_SIZE;
+		}
+	}
+
+	for (it = 0; it < iters; it++) {
+#pragma GCC unroll 8
+		for (idx = 0; idx < nlanes; idx++) {
+			b[idx] = _mm_xor_si128(_mm_shuffle_epi8(ctr[idx], bswap128), rk[0]);
+			ctr[idx] = _mm_add_epi64(ctr[idx], step[idx]);
+		}
+		for (r = 1; r < nr; r++)
+#pragma GCC unroll 8
+			for (idx = 0; idx < nlanes; idx++)
+				b[idx] = _mm_aesenc_si128(b[idx], rk[r]);
+#pragma GCC unroll 8
+		for (idx = 0; idx < nlanes; idx++) {
+			b[idx] = _mm_aesenclast_si128(b[idx], rk[nr]);
+			b[idx] = _mm_xor_si128(b[idx], _mm_loadu_si128((const __m128i *)lin[idx]));
+			_mm_storeu_si128((__m128i *)lout[idx], b[idx]);
+			lin[idx] += stride[idx];
+			lout[idx] += stride[idx];
+		}
+	}
+
+	for (idx = 0; idx < nbufs; idx++) {
+		done = iters * lanes[idx] * AES_BLOCK_SIZE;
+		aes_ni_ctr_add(&base[idx], iters * lanes[idx]);
+		aes_ni_ctr_xor(&in[idx][done], in_len[idx] - done, &out[idx][done], rk, nr, &base[idx]);
+	}
+}
+
+AES_NI_TARGET static void aes_encrypt_ctr_multi_ni(const BYTE *in[], const size_t in_len[], BYTE *out[], int nbufs,
+                                                   const WORD key[], int keysize, const BYTE *iv[])
+{
+	aes_ctr_multi_ni_lanes(in, in_len, out, nbufs, key, keysize, iv, AES_MB_LANES);
+}
+
+AES_NI_TARGET static void aes_encrypt_ctr_multi_ni4(const BYTE *in[], const size_t in_len[], BYTE *out[], int nbufs,
+                                                    const WORD key[], int keysize, const BYTE *iv[])
+{
+	aes_ctr_multi_ni_lanes(in, in_len, out, nbufs, key, keysize, iv, 4);
+}
+#endif  // AES_NI
+
 /*******************
 * AES - CBC
 *******************/
 int aes_encrypt_cbc(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
+{
+#ifdef AES_NI
+	if (aes_impl() != AES_IMPL_SW)
+		return(aes_encrypt_cbc_ni(in, in_len, out, key, keysize, iv));
+#endif
+	return(aes_encrypt_cbc_sw(in, in_len, out, key, keysize, iv));
+}
+
+static int aes_encrypt_cbc_sw(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
 {
 	BYTE buf_in[AES_BLOCK_SIZE], buf_out[AES_BLOCK_SIZE], iv_buf[AES_BLOCK_SIZE];
 	int blocks, idx;
@@ -280,6 +670,15 @@ int aes_encrypt_cbc_mac(const BYTE in[], size_t in_len, BYTE out[], const WORD k
 }
 
 int aes_decrypt_cbc(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
+{
+#ifdef AES_NI
+	if (aes_impl() != AES_IMPL_SW)
+		return(aes_decrypt_cbc_ni(in, in_len, out, key, keysize, iv));
+#endif
+	return(aes_decrypt_cbc_sw(in, in_len, out, key, keysize, iv));
+}
+
+static int aes_decrypt_cbc_sw(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
 {
 	BYTE buf_in[AES_BLOCK_SIZE], buf_out[AES_BLOCK_SIZE], iv_buf[AES_BLOCK_SIZE];
 	int blocks, idx;
@@ -320,6 +719,42 @@ void increment_iv(BYTE iv[], int counter_size)
 // Performs the encryption in-place, the input and output buffers may be the same.
 // Input may be an arbitrary length (in bytes).
 void aes_encrypt_ctr(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
+{
+#ifdef AES_NI
+	if (aes_impl() == AES_IMPL_VAES)
+		aes_encrypt_ctr_vaes(in, in_len, out, key, keysize, iv);
+	else if (aes_impl() == AES_IMPL_NI)
+		aes_encrypt_ctr_ni(in, in_len, out, key, keysize, iv);
+	else
+#endif
+	aes_encrypt_ctr_sw(in, in_len, out, key, keysize, iv);
+}
+
+// Encrypts each buffer with its own IV. With AES-NI, blocks from all of the
+// buffers are interleaved (see aes_encrypt_ctr_multi_ni).
+void aes_encrypt_ctr_multi(const BYTE *in[], const size_t in_len[], BYTE *out[], int nbufs,
+                           const WORD key[], int keysize, const BYTE *iv[])
+{
+	if (nbufs <= 0 || nbufs > AES_CTR_MAX_BUFFERS)
+		return;
+#ifdef AES_NI
+	if (aes_impl() != AES_IMPL_SW)
+		aes_encrypt_ctr_multi_ni(in, in_len, out, nbufs, key, keysize, iv);
+	else
+#endif
+	aes_encrypt_ctr_multi_sw(in, in_len, out, nbufs, key, keysize, iv);
+}
+
+static void aes_encrypt_ctr_multi_sw(const BYTE *in[], const size_t in_len[], BYTE *out[], int nbufs,
+                                     const WORD key[], int keysize, const BYTE *iv[])
+{
+	int idx;
+
+	for (idx = 0; idx < nbufs; idx++)
+		aes_encrypt_ctr_sw(in[idx], in_len[idx], out[idx], key, keysize, iv[idx]);
+}
+
+static void aes_encrypt_ctr_sw(const BYTE in[], size_t in_len, BYTE out[], const WORD key[], int keysize, const BYTE iv[])
 {
 	size_t idx = 0, last_block_length;
 	BYTE iv_buf[AES_BLOCK_SIZE], out_buf[AES_BLOCK_SIZE];
@@ -1093,3 +1528,187 @@ void print_rnd_key(WORD key[])
 	printf("\n");
 }
 */
+
+/*******************
+* Test functions
+*******************/
+// Compares each implementation the CPU supports against the NIST SP 800-38A
+// vectors (F.2.1/F.2.5 for CBC, F.5.1/F.5.5 for CTR; AES-128 and AES-256)
+// and against the portable code over lengths that are not a multiple of the
+// hardware paths' pipeline width. Returns TRUE if all match.
+static const BYTE aes_test_plaintext[64] = {
+	0x6b,0xc1,0xbe,0xe2,0x2e,0x40,0x9f,0x96,0xe9,0x3d,0x7e,0x11,0x73,0x93,0x17,0x2a,
+	0xae,0x2d,0x8a,0x57,0x1e,0x03,0xac,0x9c,0x9e,0xb7,0x6f,0xac,0x45,0xaf,0x8e,0x51,
+	0x30,0xc8,0x1c,0x46,0xa3,0x5c,0xe4,0x11,0xe5,0xfb,0xc1,0x19,0x1a,0x0a,0x52,0xef,
+	0xf6,0x9f,0x24,0x45,0xdf,0x4f,0x9b,0x17,0xad,0x2b,0x41,0x7b,0xe6,0x6c,0x37,0x10
+};
+static const BYTE aes_test_key[2][32] = {
+	{0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c},
+	{0x60,0x3d,0xeb,0x10,0x15,0xca,0x71,0xbe,0x2b,0x73,0xae,0xf0,0x85,0x7d,0x77,0x81,
+	 0x1f,0x35,0x2c,0x07,0x3b,0x61,0x08,0xd7,0x2d,0x98,0x10,0xa3,0x09,0x14,0xdf,0xf4}
+};
+static const int aes_test_keysize[2] = {128, 256};
+
+// Returns the number of implementations to test, filling "impls".
+static int aes_test_impls(int impls[])
+{
+	int n = 0;
+
+	impls[n++] = AES_IMPL_SW;
+#ifdef AES_NI
+	if (aes_impl() >= AES_IMPL_NI)
+		impls[n++] = AES_IMPL_NI;
+	if (aes_impl() >= AES_IMPL_VAES)
+		impls[n++] = AES_IMPL_VAES;
+#endif
+	return(n);
+}
+
+static int aes_test_cbc_impl(int impl, int enc, const BYTE in[], size_t in_len, BYTE out[],
+                             const WORD key[], int keysize, const BYTE iv[])
+{
+#ifdef AES_NI
+	if (impl != AES_IMPL_SW)
+		return(enc ? aes_encrypt_cbc_ni(in, in_len, out, key, keysize, iv)
+		           : aes_decrypt_cbc_ni(in, in_len, out, key, keysize, iv));
+#endif
+	return(enc ? aes_encrypt_cbc_sw(in, in_len, out, key, keysize, iv)
+	           : aes_decrypt_cbc_sw(in, in_len, out, key, keysize, iv));
+}
+
+// The multi-buffer CTR path with AES_MB_LANES lanes, or with 4 (lanes4).
+static void aes_test_ctr_multi_impl(int lanes4, const BYTE *in[], const size_t in_len[], BYTE *out[], int nbufs,
+                                    const WORD key[], int keysize, const BYTE *iv[])
+{
+#ifdef AES_NI
+	if (lanes4 && aes_impl() != AES_IMPL_SW)
+		return(aes_encrypt_ctr_multi_ni4(in, in_len, out, nbufs, key, keysize, iv));
+#endif
+	aes_encrypt_ctr_multi(in, in_len, out, nbufs, key, keysize, iv);
+}
+
+static void aes_test_ctr_impl(int impl, const BYTE in[], size_t in_len, BYTE out[],
+                              const WORD key[], int keysize, const BYTE iv[])
+{
+#ifdef AES_NI
+	if (impl == AES_IMPL_VAES)
+		return(aes_encrypt_ctr_vaes(in, in_len, out, key, keysize, iv));
+	if (impl == AES_IMPL_NI)
+		return(aes_encrypt_ctr_ni(in, in_len, out, key, keysize, iv));
+#endif
+	aes_encrypt_ctr_sw(in, in_len, out, key, keysize, iv);
+}
+
+int aes_cbc_test()
+{
+	WORD key_schedule[60];
+	BYTE iv[AES_BLOCK_SIZE] = {0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f};
+	BYTE ciphertext[2][64] = {
+		{0x76,0x49,0xab,0xac,0x81,0x19,0xb2,0x46,0xce,0xe9,0x8e,0x9b,0x12,0xe9,0x19,0x7d,
+		 0x50,0x86,0xcb,0x9b,0x50,0x72,0x19,0xee,0x95,0xdb,0x11,0x3a,0x91,0x76,0x78,0xb2,
+		 0x73,0xbe,0xd6,0xb8,0xe3,0xc1,0x74,0x3b,0x71,0x16,0xe6,0x9e,0x22,0x22,0x95,0x16,
+		 0x3f,0xf1,0xca,0xa1,0x68,0x1f,0xac,0x09,0x12,0x0e,0xca,0x30,0x75,0x86,0xe1,0xa7},
+		{0xf5,0x8c,0x4c,0x04,0xd6,0xe5,0xf1,0xba,0x77,0x9e,0xab,0xfb,0x5f,0x7b,0xfb,0xd6,
+		 0x9c,0xfc,0x4e,0x96,0x7e,0xdb,0x80,0x8d,0x67,0x9f,0x77,0x7b,0xc6,0x70,0x2c,0x7d,
+		 0x39,0xf2,0x33,0x69,0xa9,0xd9,0xba,0xcf,0xa5,0x30,0xe2,0x63,0x04,0x23,0x14,0x61,
+		 0xb2,0xeb,0x05,0xe2,0xc3,0x9b,0xe9,0xfc,0xda,0x6c,0x19,0x07,0x8c,0x6a,0x9d,0x1b}
+	};
+	BYTE buf[80], ref[80], data[80];
+	int impls[3], nimpls, idx, k, len, pass = 1;
+
+	nimpls = aes_test_impls(impls);
+	for (idx = 0; idx < (int)sizeof(data); idx++)
+		data[idx] = idx * 7 + 3;
+
+	for (k = 0; k < 2; k++) {
+		aes_key_setup(aes_test_key[k], key_schedule, aes_test_keysize[k]);
+		for (idx = 0; idx < nimpls; idx++) {
+			aes_test_cbc_impl(impls[idx], 1, aes_test_plaintext, 64, buf, key_schedule, aes_test_keysize[k], iv);
+			pass = pass && !memcmp(buf, ciphertext[k], 64);
+			aes_test_cbc_impl(impls[idx], 0, ciphertext[k], 64, buf, key_schedule, aes_test_keysize[k], iv);
+			pass = pass && !memcmp(buf, aes_test_plaintext, 64);
+
+			// 1 to 5 blocks, against the portable code
+			for (len = AES_BLOCK_SIZE; len <= (int)sizeof(data); len += AES_BLOCK_SIZE) {
+				aes_encrypt_cbc_sw(data, len, ref, key_schedule, aes_test_keysize[k], iv);
+				aes_test_cbc_impl(impls[idx], 1, data, len, buf, key_schedule, aes_test_keysize[k], iv);
+				pass = pass && !memcmp(buf, ref, len);
+				aes_test_cbc_impl(impls[idx], 0, ref, len, buf, key_schedule, aes_test_keysize[k], iv);
+				pass = pass && !memcmp(buf, data, len);
+			}
+		}
+	}
+
+	return(pass);
+}
+
+int aes_ctr_test()
+{
+	WORD key_schedule[60];
+	BYTE iv[2][AES_BLOCK_SIZE] = {
+		{0xf0,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa,0xfb,0xfc,0xfd,0xfe,0xff},
+		{0xf0,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xfe}  // carries
+	};
+	BYTE ciphertext[2][64] = {
+		{0x87,0x4d,0x61,0x91,0xb6,0x20,0xe3,0x26,0x1b,0xef,0x68,0x64,0x99,0x0d,0xb6,0xce,
+		 0x98,0x06,0xf6,0x6b,0x79,0x70,0xfd,0xff,0x86,0x17,0x18,0x7b,0xb9,0xff,0xfd,0xff,
+		 0x5a,0xe4,0xdf,0x3e,0xdb,0xd5,0xd3,0x5e,0x5b,0x4f,0x09,0x02,0x0d,0xb0,0x3e,0xab,
+		 0x1e,0x03,0x1d,0xda,0x2f,0xbe,0x03,0xd1,0x79,0x21,0x70,0xa0,0xf3,0x00,0x9c,0xee},
+		{0x60,0x1e,0xc3,0x13,0x77,0x57,0x89,0xa5,0xb7,0xa7,0xf5,0x04,0xbb,0xf3,0xd2,0x28,
+		 0xf4,0x43,0xe3,0xca,0x4d,0x62,0xb5,0x9a,0xca,0x84,0xe9,0x90,0xca,0xca,0xf5,0xc5,
+		 0x2b,0x09,0x30,0xda,0xa2,0x3d,0xe9,0x4c,0xe8,0x70,0x17,0xba,0x2d,0x84,0x98,0x8d,
+		 0xdf,0xc9,0xc5,0x8d,0xb6,0x7a,0xad,0xa6,0x13,0xc2,0xdd,0x08,0x45,0x79,0x41,0xa6}
+	};
+	BYTE buf[300], ref[300], data[300], mbuf[5][300];
+	const BYTE *mb_in[5], *mb_iv[5];
+	BYTE *mb_out[5];
+	size_t mb_len[5];
+	int impls[3], nimpls, idx, k, m, v, len, pass = 1;
+
+	nimpls = aes_test_impls(impls);
+	for (idx = 0; idx < (int)sizeof(data); idx++)
+		data[idx] = idx * 7 + 3;
+
+	for (k = 0; k < 2; k++) {
+		aes_key_setup(aes_test_key[k], key_schedule, aes_test_keysize[k]);
+		for (idx = 0; idx < nimpls; idx++) {
+			aes_test_ctr_impl(impls[idx], aes_test_plaintext, 64, buf, key_schedule, aes_test_keysize[k], iv[0]);
+			pass = pass && !memcmp(buf, ciphertext[k], 64);
+			aes_test_ctr_impl(impls[idx], ciphertext[k], 64, buf, key_schedule, aes_test_keysize[k], iv[0]);
+			pass = pass && !memcmp(buf, aes_test_plaintext, 64);
+
+			// any length, and a counter that carries into the high half
+			for (v = 0; v < 2; v++) {
+				for (len = 0; len <= (int)sizeof(data); len += 13) {
+					aes_encrypt_ctr_sw(data, len, ref, key_schedule, aes_test_keysize[k], iv[v]);
+					aes_test_ctr_impl(impls[idx], data, len, buf, key_schedule, aes_test_keysize[k], iv[v]);
+					pass = pass && !memcmp(buf, ref, len);
+					memcpy(buf, data, len);  // in place
+					aes_test_ctr_impl(impls[idx], buf, len, buf, key_schedule, aes_test_keysize[k], iv[v]);
+					pass = pass && !memcmp(buf, ref, len);
+				}
+			}
+		}
+
+		// multi-buffer: uneven lengths so that buffers drop out of the
+		// pipeline at different times, each checked against a single call;
+		// with 4 lanes too, where 5 buffers are more than there are lanes
+		for (m = 0; m < 2; m++) {
+			for (v = 1; v <= 5; v++) {
+				for (idx = 0; idx < v; idx++) {
+					mb_in[idx] = data + idx;
+					mb_len[idx] = sizeof(data) - 61 * idx - 7 * v;
+					mb_out[idx] = mbuf[idx];
+					mb_iv[idx] = iv[idx % 2];
+				}
+				aes_test_ctr_multi_impl(m, mb_in, mb_len, mb_out, v, key_schedule, aes_test_keysize[k], mb_iv);
+				for (idx = 0; idx < v; idx++) {
+					aes_encrypt_ctr_sw(mb_in[idx], mb_len[idx], ref, key_schedule, aes_test_keysize[k], mb_iv[idx]);
+					pass = pass && !memcmp(mbuf[idx], ref, mb_len[idx]);
+				}
+			}
+		}
+	}
+
+	return(pass);
+}
@@ -14,6 +14,7 @@
 
 /****************************** MACROS ******************************/
 #define AES_BLOCK_SIZE 16               // AES operates on 16 bytes at a time
+#define AES_CTR_MAX_BUFFERS 8           // For aes_encrypt_ctr_multi()
 
 /**************************** DATA TYPES ****************************/
 typedef unsigned char BYTE;            // 8-bit byte
@@ -38,6 +39,9 @@ void aes_decrypt(const BYTE in[],             // 16 bytes of ciphertext
                  const WORD key[],            // From the key setup
                  int keysize);                // Bit length of the key, 128, 192, or 256
 
+// The CBC and CTR functions below run on AES-NI (or VAES for CTR) when the
+// CPU has it, picked at runtime; build with -DAES_NO_NI for portable code only.
+
 ///////////////////
 // AES - CBC
 ///////////////////
@@ -69,6 +73,17 @@ void aes_encrypt_ctr(const BYTE in[],         // Plaintext
                      int keysize,             // Bit length of the key, 128, 192, or 256
                      const BYTE iv[]);        // IV, must be AES_BLOCK_SIZE bytes long
 
+// Encrypts several independent buffers in CTR mode, each with its own IV, as
+// if by one aes_encrypt_ctr() call per buffer. The hardware path interleaves
+// blocks of all the buffers to keep several in flight.
+void aes_encrypt_ctr_multi(const BYTE *in[],  // Plaintexts
+                     const size_t in_len[],   // Any byte lengths
+                     BYTE *out[],             // Ciphertexts, same lengths as plaintexts
+                     int nbufs,               // Number of buffers, up to AES_CTR_MAX_BUFFERS
+                     const WORD key[],        // From the key setup
+                     int keysize,             // Bit length of the key, 128, 192, or 256
+                     const BYTE *iv[]);       // IVs, each AES_BLOCK_SIZE bytes long
+
 void aes_decrypt_ctr(const BYTE in[],         // Ciphertext
                      size_t in_len,           // Any byte length
                      BYTE out[],              // Plaintext, same length as ciphertext
@@ -77,6 +77,10 @@
 #include "rmem/common.h"
 #define RMALLOC		rmalloc
 #define RFREE		  rmfree
+#elif defined(ZTIER)
+#include "ztier.h"
+#define RMALLOC		ztier_malloc
+#define RFREE		  ztier_free
 #else
 #define RMALLOC		malloc
 #define RFREE		  free
@@ -113,6 +117,11 @@
 #define GET_CURRENT_LOCAL_MEM()     get_memory_usage()
 #define LOCK_MEMORY(addr,len)       mlock(addr,len)
 #define UNLOCK_MEMORY(addr,len)     munlock(addr,len)
+#elif defined(ZTIER)
+#define SET_MAX_LOCAL_MEM(limit)    ztier_set_local_mem(limit)
+#define GET_CURRENT_LOCAL_MEM()     ztier_local_mem()
+#define LOCK_MEMORY(addr,len)       {}
+#define UNLOCK_MEMORY(addr,len)     {}
 #else
 #define SET_MAX_LOCAL_MEM(limit)    {}
 #define GET_CURRENT_LOCAL_MEM()     0
@@ -197,8 +206,21 @@ static inline bool atomic_cmpxchg(atomic_t *a, int oldv, int newv)
 {
 	return __sync_bool_compare_and_swap(&a->cnt, oldv, newv);
 }
+
+static inline int atomic_fetch_and_add(atomic_t *a, int val)
+{
+	return __sync_fetch_and_add(&a->cnt, val);
+}
 #endif
 
+/* x86 is TSO: only loads can pass older stores, so read-read and
+ * write-write ordering just needs to stop the compiler */
+#ifndef smp_rmb
+#define smp_rmb() barrier()
+#endif
+#ifndef smp_wmb
+#define smp_wmb() barrier()
+#endif
 
 /********************************************
   logging
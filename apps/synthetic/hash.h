@@ -0,0 +1,86 @@
+/*
+ * hash.h - hash functions for short, fixed-width keys
+ */
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+#include <string.h>
+#ifdef SHENANGO
+#include "asm/ops.h"
+#else
+#include "ops.h"
+#endif
+
+#define HASH_SEED			0x9e3779b97f4a7c15ull
+
+/* unaligned loads; the key is read in 8-byte words and the last, partial
+ * word is zero-padded. with a constant length these all fold away */
+static inline uint64_t hash_load_word(const uint8_t *p, size_t len)
+{
+	uint64_t v = 0;
+	memcpy(&v, p, len < 8 ? len : 8);
+	return v;
+}
+
+/**
+ * hash_crc32c - hashes a key with the SSE4.2 CRC32C instruction, one
+ * 8-byte word at a time (two instructions for a 12-byte key)
+ */
+static inline __attribute__((always_inline))
+uint32_t hash_crc32c(const void *key, size_t len)
+{
+	const uint8_t *p = key;
+	uint64_t crc = (uint32_t) HASH_SEED;
+	size_t i;
+
+	for (i = 0; i < len; i += 8)
+		crc = __mm_crc32_u64(crc, hash_load_word(p + i, len - i));
+	return (uint32_t) crc;
+}
+
+/* 64x64->128 bit multiply, folded */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/**
+ * hash_wy - wyhash-style multiply-mix hash for hosts without SSE4.2.
+ * Keys of up to 16 bytes take a single multiply
+ */
+static inline __attribute__((always_inline))
+uint32_t hash_wy(const void *key, size_t len)
+{
+	const uint8_t *p = key;
+	uint64_t a, b, seed = HASH_SEED ^ len;
+	size_t i;
+
+	for (i = 0; i + 16 < len; i += 16)
+		seed = hash_mix(hash_load_word(p + i, 8) ^ 0xa0761d6478bd642full,
+			hash_load_word(p + i + 8, 8) ^ seed);
+	a = hash_load_word(p + i, len - i);
+	b = (len - i > 8) ? hash_load_word(p + i + 8, len - i - 8) : 0;
+	seed = hash_mix(a ^ 0xa0761d6478bd642full, b ^ seed);
+	seed = hash_mix(seed ^ 0xe7037ed1a0b428dbull, len ^ 0x8ebc6af09c88c6e3ull);
+	return (uint32_t) (seed ^ (seed >> 32));
+}
+
+/**
+ * hash_key - hashes a key of _len_ bytes. Meant for keys whose length
+ * is a compile-time constant so that it specializes to straight-line
+ * code for that width
+ */
+static inline __attribute__((always_inline))
+uint32_t hash_key(const void *key, size_t len)
+{
+#ifdef __SSE4_2__
+	return hash_crc32c(key, len);
+#else
+	return hash_wy(key, len);
+#endif
+}
+
+#endif  // __HASH_H__
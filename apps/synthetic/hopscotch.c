@@ -21,9 +21,14 @@
  * SOFTWARE.
  */
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
+#include "hash.h"
 #include "hopscotch.h"
 #include "utils.h"
 #include "common.h"
@@ -50,81 +55,305 @@ _jenkins_hash(uint8_t *key, size_t len)
     return hash;
 }
 
+/*
+ * Hash of a key: CRC32C (or a multiply-mix hash without SSE4.2) 
+ * specialized for KEY_LEN, see hash.h. Jenkins for comparison
+ */
+static __inline__ uint32_t
+_hash(void *key)
+{
+#ifdef JENKINS_HASH
+    return _jenkins_hash(key, KEY_LEN);
+#else
+    return hash_key(key, KEY_LEN);
+#endif
+}
+
+#ifdef USE_FINGERPRINTS
+/*
+ * Fingerprint of a key: bucket index comes from the low bits of the 
+ * hash so mix in all bits to keep colliding keys apart
+ */
+static __inline__ uint8_t
+_fingerprint(uint32_t h)
+{
+    return (uint8_t)((h * 0x9e3779b1u) >> 24);
+}
+
+/*
+ * Bitmap of buckets in a neighborhood whose fingerprint matches. The
+ * fingerprint array is padded so that the last neighborhoods can be 
+ * loaded whole.
+ */
+BUILD_ASSERT(HOPSCOTCH_HOPINFO_SIZE == 32);
+static __inline__ uint32_t
+_fingerprint_match(const uint8_t *fps, uint8_t fp)
+{
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *) fps);
+    return (uint32_t) _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(fp)));
+#elif defined(__SSE2__)
+    __m128i f = _mm_set1_epi8(fp);
+    uint32_t lo, hi;
+    lo = _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *) fps), f));
+    hi = _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *) (fps + 16)), f));
+    return lo | (hi << 16);
+#else
+    uint32_t mask = 0;
+    int i;
+    for ( i = 0; i < HOPSCOTCH_HOPINFO_SIZE; i++ )
+        if ( fps[i] == fp )
+            mask |= (1U << i);
+    return mask;
+#endif
+}
+#endif
+
+
+/*
+ * Per-anchor rw lock and timestamp, either in the bucket itself or
+ * striped in a separate array with the compact layout
+ */
+#ifdef COMPACT_BUCKETS
+BUILD_ASSERT(sizeof(struct hopscotch_bucket) == 32);
+#define ANCHOR_RW_LOCK(t, idx)      \
+    (&(t)->anchor_locks[(idx) / BUCKETS_PER_ANCHOR_LOCK].rw_lock)
+#define ANCHOR_TIMESTAMP(t, idx)    \
+    (&(t)->anchor_locks[(idx) / BUCKETS_PER_ANCHOR_LOCK].timestamp)
+#else
+#define ANCHOR_RW_LOCK(t, idx)      (&(t)->buckets[idx].rw_lock)
+#define ANCHOR_TIMESTAMP(t, idx)    (&(t)->buckets[idx].timestamp)
+#endif
+
+/* overflow buckets also pad the fingerprints for whole-neighborhood loads */
+BUILD_ASSERT(HOPSCOTCH_ADD_RANGE >= HOPSCOTCH_HOPINFO_SIZE);
+
 /*
  * Fine-grained locking of bucket kv data
  */
-static __inline__ void 
-bucket_data_lock(struct hopscotch_hash_table *ht, 
-        int bucket_id, 
+static __inline__ void
+bucket_data_lock(struct hopscotch_table *t,
+        int bucket_id,
         int prev_bucket_id) {
 #ifdef LOCK_INSIDE_BUCKET
-    struct hopscotch_bucket* b = &(ht->buckets[bucket_id]);
+    struct hopscotch_bucket* b = &(t->buckets[bucket_id]);
     SPIN_LOCK(&b->kv_lock);
 #else
     int lock_id = bucket_id / BUCKETS_PER_LOCK;
-    if (prev_bucket_id > 0 && 
+    if (prev_bucket_id > 0 &&
         lock_id == prev_bucket_id / BUCKETS_PER_LOCK)
         /* already have the lock */
         return;
-    SPIN_LOCK(&ht->kv_locks[lock_id]);
+    SPIN_LOCK(&t->kv_locks[lock_id]);
 #endif
 }
 
-static __inline__ void 
-bucket_data_unlock(struct hopscotch_hash_table *ht,
-        int bucket_id, 
+static __inline__ void
+bucket_data_unlock(struct hopscotch_table *t,
+        int bucket_id,
         int prev_bucket_id) {
 #ifdef LOCK_INSIDE_BUCKET
-    struct hopscotch_bucket* b = &(ht->buckets[bucket_id]);
+    struct hopscotch_bucket* b = &(t->buckets[bucket_id]);
     SPIN_UNLOCK(&b->kv_lock);
 #else
     /* shared locks */
     int lock_id = bucket_id / BUCKETS_PER_LOCK;
-    if (prev_bucket_id > 0 && 
+    if (prev_bucket_id > 0 &&
         lock_id == prev_bucket_id / BUCKETS_PER_LOCK)
         /* already have the lock */
         return;
-    SPIN_UNLOCK(&ht->kv_locks[lock_id]);
+    SPIN_UNLOCK(&t->kv_locks[lock_id]);
 #endif
 }
 
 /*
- * Initialize the hash table
+ * Sequence counter on bucket kv data. Writers (already serialized by
+ * bucket_data_lock) keep it odd for the duration of an update so that
+ * readers can copy the data without locking and retry on a race.
  */
-struct hopscotch_hash_table *
-hopscotch_init(struct hopscotch_hash_table *ht, size_t exponent)
+static __inline__ void
+bucket_write_begin(struct hopscotch_bucket *b) {
+    ACCESS_ONCE(b->seq) = b->seq + 1;
+    smp_wmb();
+}
+
+static __inline__ void
+bucket_write_end(struct hopscotch_bucket *b) {
+    smp_wmb();
+    ACCESS_ONCE(b->seq) = b->seq + 1;
+}
+
+static __inline__ void
+bucket_data_read(struct hopscotch_bucket *b, uint8_t *key, void **data) {
+    uint32_t seq;
+    while (1) {
+        seq = load_acquire(&b->seq);
+        if (unlikely(seq & 1)) {
+            /* writer in progress */
+            cpu_relax();
+            continue;
+        }
+        memcpy(key, b->key, KEY_LEN);
+        *data = b->data;
+        smp_rmb();
+        if (likely(seq == ACCESS_ONCE(b->seq)))
+            return;
+    }
+}
+
+/*
+ * Allocate a bucket array of the given size
+ */
+static struct hopscotch_table *
+_table_alloc(size_t exponent)
 {
-    /* Allocate buckets first */
-    int i;
+    size_t i;
+    struct hopscotch_table *t;
     struct hopscotch_bucket *buckets;
-    size_t nbuckets = (1 << exponent);
-    pr_info("memory for hash table: %lu MB", 
+    /* overflow buckets at the end so that probing never wraps around */
+    size_t nbuckets = (1ULL << exponent) + HOPSCOTCH_ADD_RANGE;
+
+    t = malloc(sizeof(struct hopscotch_table));
+    if ( NULL == t ) {
+        return NULL;
+    }
+    memset(t, 0, sizeof(struct hopscotch_table));
+    t->exponent = exponent;
+
+    pr_info("memory for hash table: %lu MB",
         sizeof(struct hopscotch_bucket) * nbuckets / (1<<20));
+#ifdef COMPACT_BUCKETS
+    /* page-align so that no bucket straddles pages or cache lines */
+    void* bucket_mem;
+    bucket_mem = RMALLOC(sizeof(struct hopscotch_bucket) * nbuckets + _PAGE_SIZE);
+    if ( NULL == bucket_mem ) {
+        goto err;
+    }
+    buckets = (struct hopscotch_bucket *)
+        (((unsigned long) bucket_mem + _PAGE_SIZE - 1) & _PAGE_MASK);
+    t->_buckets_mem = bucket_mem;
+#else
     buckets = RMALLOC(sizeof(struct hopscotch_bucket) * nbuckets);
     if ( NULL == buckets ) {
-        return NULL;
+        goto err;
     }
-    pr_info("hash table memory start: %p, end: 0x%lx", buckets, 
+#endif
+    pr_info("hash table memory start: %p, end: 0x%lx", buckets,
         (unsigned long) buckets + sizeof(struct hopscotch_bucket) * nbuckets);
     memset(buckets, 0, sizeof(struct hopscotch_bucket) * nbuckets);
+    t->buckets = buckets;
+
+#ifdef USE_FINGERPRINTS
+    t->fingerprints = RMALLOC(nbuckets);
+    if ( NULL == t->fingerprints ) {
+        goto err;
+    }
+    memset(t->fingerprints, 0, nbuckets);
+    pr_info("memory for hash table fingerprints: %lu KB", nbuckets / (1<<10));
+#endif
+
 #ifdef THREAD_SAFE
-    for (i = nbuckets; i >= 0; i--) {
+    for (i = 0; i < nbuckets; i++) {
+#ifndef COMPACT_BUCKETS
         MUTEX_INIT(&buckets[i].rw_lock);
         SPIN_LOCK_INIT(&buckets[i].kv_lock);
+#endif
         buckets[i].marked = (atomic_t) ATOMIC_INIT(0);
     }
 
+#ifdef COMPACT_BUCKETS
+    size_t nanchorlocks = (nbuckets / BUCKETS_PER_ANCHOR_LOCK) + 1;
+    struct hopscotch_anchor_lock* anchor_locks =
+        RMALLOC(sizeof(struct hopscotch_anchor_lock) * nanchorlocks);
+    if ( NULL == anchor_locks ) {
+        goto err;
+    }
+    t->anchor_locks = anchor_locks;
+    for (i = 0; i < nanchorlocks; i++) {
+        MUTEX_INIT(&anchor_locks[i].rw_lock);
+        anchor_locks[i].timestamp = 0;
+    }
+    pr_info("number of hash table anchor locks: %lu", nanchorlocks);
+    pr_info("memory for hash table anchor locks: %lu KB",
+        sizeof(struct hopscotch_anchor_lock) * nanchorlocks / (1<<10));
+#endif
+
     size_t nlocks = (nbuckets / BUCKETS_PER_LOCK) + 1;
-   SPINLOCK_T* spinlocks = RMALLOC(sizeof(SPINLOCK_T) * nlocks);
+    SPINLOCK_T* spinlocks = RMALLOC(sizeof(SPINLOCK_T) * nlocks);
+    if ( NULL == spinlocks ) {
+        goto err;
+    }
     for (i = 0; i < nlocks; i++)
         SPIN_LOCK_INIT(&spinlocks[i]);
+    t->kv_locks = spinlocks;
 #ifndef LOCK_INSIDE_BUCKET
     pr_info("number of hash table locks: %lu", nlocks);
-    pr_info("memory for hash table locks: %lu KB", 
+    pr_info("memory for hash table locks: %lu KB",
         sizeof(SPINLOCK_T) * nlocks / (1<<10));
 #endif
 #endif
 
+    t->migrate_next = (atomic_t) ATOMIC_INIT(0);
+    t->migrate_done = (atomic_t) ATOMIC_INIT(0);
+    return t;
+
+err:
+    /* free whatever was allocated before the failure */
+#ifdef COMPACT_BUCKETS
+    if ( t->anchor_locks )
+        RFREE(t->anchor_locks);
+    if ( t->_buckets_mem )
+        RFREE(t->_buckets_mem);
+#else
+    if ( t->buckets )
+        RFREE(t->buckets);
+#endif
+#ifdef USE_FINGERPRINTS
+    if ( t->fingerprints )
+        RFREE(t->fingerprints);
+#endif
+    free(t);
+    return NULL;
+}
+
+/*
+ * Free a bucket array
+ */
+static void
+_table_free(struct hopscotch_table *t)
+{
+#ifdef COMPACT_BUCKETS
+    RFREE(t->_buckets_mem);
+    RFREE(t->anchor_locks);
+#else
+    RFREE(t->buckets);
+#endif
+#ifdef THREAD_SAFE
+    RFREE((void*) t->kv_locks);
+#endif
+#ifdef USE_FINGERPRINTS
+    RFREE(t->fingerprints);
+#endif
+    free(t);
+}
+
+/*
+ * Initialize the hash table
+ */
+struct hopscotch_hash_table *
+hopscotch_init(struct hopscotch_hash_table *ht, size_t exponent)
+{
+    struct hopscotch_table *t;
+
+    /* Allocate buckets first */
+    t = _table_alloc(exponent);
+    if ( NULL == t ) {
+        return NULL;
+    }
+
     if ( NULL == ht ) {
         ht = malloc(sizeof(struct hopscotch_hash_table));
         if ( NULL == ht ) {
@@ -134,20 +363,133 @@ hopscotch_init(struct hopscotch_hash_table *ht, size_t exponent)
     } else {
         ht->_allocated = 0;
     }
-    ht->exponent = exponent;
-    ht->buckets = buckets;
-    ht->kv_locks = spinlocks; 
+    ht->table = t;
+    ht->old = NULL;
+    ht->resize_seq = 0;
+    ht->retired = NULL;
+    MUTEX_INIT(&ht->resize_lock);
 
     return ht;
 }
 
+/*
+ * Free tables that were resized out of. Not thread-safe: there must
+ * be no lookups in flight that started before the last resize ended
+ */
+void
+hopscotch_reclaim(struct hopscotch_hash_table *ht)
+{
+    struct hopscotch_table *t;
+
+    while ( ht->retired ) {
+        t = ht->retired;
+        ht->retired = t->next_retired;
+        _table_free(t);
+    }
+}
+
+/*
+ * Chi-squared check of how evenly keys landed in bins. For a uniform
+ * hash it is about (nbins - 1) +/- sqrt(2 * (nbins - 1))
+ */
+static int
+_hash_spread(const char *name, uint32_t *counts, size_t nbins, size_t nkeys)
+{
+    double expected, chi2, dev;
+    size_t i, max;
+
+    expected = (double) nkeys / nbins;
+    chi2 = 0;
+    max = 0;
+    for ( i = 0; i < nbins; i++ ) {
+        dev = counts[i] - expected;
+        chi2 += dev * dev / expected;
+        max = (counts[i] > max) ? counts[i] : max;
+    }
+    dev = (chi2 - (nbins - 1)) / sqrt(2.0 * (nbins - 1));
+    pr_info("hash spread over %s: chi2 %.0f for %lu bins (%+.1f sd), "
+        "max %lu per bin (mean %.1f)", name, chi2, nbins, dev, max, expected);
+    /* too even is fine, e.g., crc of sequential keys */
+    return (dev > 6) ? -1 : 0;
+}
+
+/*
+ * Hash quality test: spread of a few key patterns over the bucket index
+ * of a table of the given size (and over fingerprints). Returns 0 if
+ * all of them look uniform
+ */
+int
+hopscotch_hash_test(size_t exponent)
+{
+    size_t nbuckets, nkeys, i, p, j;
+    uint32_t *counts, *fpcounts, h;
+    uint8_t key[KEY_LEN];
+    uint64_t r;
+    struct syn_rand_state rs;
+    const char *patterns[] = {"sequential keys", "keys varying in last word",
+        "random keys"};
+    int ret = 0;
+
+    nbuckets = 1ULL << exponent;
+    nkeys = 4 * nbuckets;
+    counts = malloc(nbuckets * sizeof(uint32_t));
+    fpcounts = malloc(256 * sizeof(uint32_t));
+    ASSERT(counts && fpcounts);
+    ASSERTZ(syn_rand_seed(&rs, 1));
+
+    for ( p = 0; p < 3; p++ ) {
+        memset(counts, 0, nbuckets * sizeof(uint32_t));
+        memset(fpcounts, 0, 256 * sizeof(uint32_t));
+        for ( i = 0; i < nkeys; i++ ) {
+            memset(key, 0xff, KEY_LEN);
+            switch (p) {
+            case 0:
+                /* what the synthetic app uses */
+                *(uint32_t*)key = i;
+                break;
+            case 1:
+                *(uint32_t*)(key + KEY_LEN - 4) = i;
+                break;
+            default:
+                for ( j = 0; j < KEY_LEN; j += 8 ) {
+                    r = syn_rand_next(&rs);
+                    memcpy(key + j, &r, min(KEY_LEN - j, sizeof(r)));
+                }
+            }
+            h = _hash(key);
+            counts[h & (nbuckets - 1)]++;
+#ifdef USE_FINGERPRINTS
+            fpcounts[_fingerprint(h)]++;
+#endif
+        }
+        pr_info("hash test: %s", patterns[p]);
+        ret |= _hash_spread("buckets", counts, nbuckets, nkeys);
+#ifdef USE_FINGERPRINTS
+        ret |= _hash_spread("fingerprints", fpcounts, 256, nkeys);
+#endif
+    }
+
+    free(counts);
+    free(fpcounts);
+    return ret;
+}
+
 /*
  * Release the hash table
  */
 void
 hopscotch_release(struct hopscotch_hash_table *ht)
 {
-    RFREE(ht->buckets);
+    struct hopscotch_table *t;
+
+    hopscotch_reclaim(ht);
+    while ( ht->old ) {
+        t = ht->old;
+        ht->old = t->next_old;
+        _table_free(t);
+    }
+    _table_free(ht->table);
+    MUTEX_DESTROY(&ht->resize_lock);
     if ( ht->_allocated ) {
         free(ht);
     }
@@ -160,25 +502,26 @@ hopscotch_release(struct hopscotch_hash_table *ht)
 void *
 hopscotch_lookup(struct hopscotch_hash_table *ht, void *key, int* found)
 {
+    struct hopscotch_table *t = ht->table;
     uint32_t h;
     size_t idx;
     size_t i;
     size_t sz;
 
-    sz = 1ULL << ht->exponent;
-    h = _jenkins_hash(key,KEY_LEN);
+    sz = 1ULL << t->exponent;
+    h = _hash(key);
     idx = h & (sz - 1);
 
-    if ( !ht->buckets[idx].hopinfo ) {
+    if ( !t->buckets[idx].hopinfo ) {
         *found = 0;
         return NULL;
     }
     for ( i = 0; i < HOPSCOTCH_HOPINFO_SIZE; i++ ) {
-        if ( ht->buckets[idx].hopinfo & (1 << i) ) {
-            if ( 0 == memcmp(key, ht->buckets[idx + i].key, KEY_LEN) ) {
+        if ( t->buckets[idx].hopinfo & (1 << i) ) {
+            if ( 0 == memcmp(key, t->buckets[idx + i].key, KEY_LEN) ) {
                 /* Found */
                 *found = 1;
-                return ht->buckets[idx + i].data;
+                return t->buckets[idx + i].data;
             }
         }
     }
@@ -186,6 +529,22 @@ hopscotch_lookup(struct hopscotch_hash_table *ht, void *key, int* found)
     return NULL;
 }
 
+/*
+ * Batched lookup
+ */
+int
+hopscotch_lookup_batch(struct hopscotch_hash_table *ht, void **keys, int n,
+        void **values, int *found)
+{
+    int i, nfound = 0;
+
+    for ( i = 0; i < n; i++ ) {
+        values[i] = hopscotch_lookup(ht, keys[i], &found[i]);
+        nfound += found[i];
+    }
+    return nfound;
+}
+
 
 /*
  * Insert an entry to the hash table
@@ -193,41 +552,44 @@ hopscotch_lookup(struct hopscotch_hash_table *ht, void *key, int* found)
 int
 hopscotch_insert(struct hopscotch_hash_table *ht, void *key, void *data)
 {
+    struct hopscotch_table *t = ht->table;
     uint32_t h;
     size_t idx;
     size_t i;
     size_t sz;
     size_t off;
     size_t j;
+    int found;
 
     /* Ensure the key does not exist.  Duplicate keys are not allowed. */
-    if ( NULL != hopscotch_lookup(ht, key) ) {
+    hopscotch_lookup(ht, key, &found);
+    if ( found ) {
         /* The key already exists. */
         return -1;
     }
 
-    sz = 1ULL << ht->exponent;
-    h = _jenkins_hash(key,KEY_LEN);
+    sz = 1ULL << t->exponent;
+    h = _hash(key);
     idx = h & (sz - 1);
 
     /* Linear probing to find an empty bucket */
-    for ( i = idx; i < sz; i++ ) {
-        if ( ! ht->buckets[i].taken ) {
+    for ( i = idx; i < idx + HOPSCOTCH_ADD_RANGE; i++ ) {
+        if ( ! t->buckets[i].taken ) {
             /* Found an available bucket */
-            ht->buckets[i].taken = 1;       /* TODO need CAS op */
+            t->buckets[i].taken = 1;       /* TODO need CAS op */
             while ( i - idx >= HOPSCOTCH_HOPINFO_SIZE ) {
                 for ( j = 1; j < HOPSCOTCH_HOPINFO_SIZE; j++ ) {
-                    if ( ht->buckets[i - j].hopinfo ) {
-                        off = __builtin_ctz(ht->buckets[i - j].hopinfo);
+                    if ( t->buckets[i - j].hopinfo ) {
+                        off = __builtin_ctz(t->buckets[i - j].hopinfo);
                         if ( off >= j ) {
                             continue;
                         }
-                        memcpy(ht->buckets[i].key, ht->buckets[i - j + off].key, KEY_LEN);
-                        ht->buckets[i].data = ht->buckets[i - j + off].data;
-                        memset(ht->buckets[idx + i].key, 0, KEY_LEN);
-                        ht->buckets[i - j + off].data = NULL;
-                        ht->buckets[i - j].hopinfo &= ~(1ULL << off);
-                        ht->buckets[i - j].hopinfo |= (1ULL << j);
+                        memcpy(t->buckets[i].key, t->buckets[i - j + off].key, KEY_LEN);
+                        t->buckets[i].data = t->buckets[i - j + off].data;
+                        memset(t->buckets[i - j + off].key, 0, KEY_LEN);
+                        t->buckets[i - j + off].data = NULL;
+                        t->buckets[i - j].hopinfo &= ~(1ULL << off);
+                        t->buckets[i - j].hopinfo |= (1ULL << j);
                         i = i - j + off;
                         break;
                     }
@@ -240,10 +602,10 @@ hopscotch_insert(struct hopscotch_hash_table *ht, void *key, void *data)
             }
 
             off = i - idx;
-            memcpy(ht->buckets[i].key, key, KEY_LEN);
-            ht->buckets[i].data = data;
-            ht->buckets[idx].hopinfo |= (1ULL << off);
-            ASSERT(ht->buckets[i].taken);
+            memcpy(t->buckets[i].key, key, KEY_LEN);
+            t->buckets[i].data = data;
+            t->buckets[idx].hopinfo |= (1ULL << off);
+            ASSERT(t->buckets[i].taken);
             return 0;
         }
     }
@@ -251,6 +613,7 @@ hopscotch_insert(struct hopscotch_hash_table *ht, void *key, void *data)
     /* need to resize the table (error out for now) */
     pr_err("hash table full");
     ASSERT(0);
+    return -1;
 }
 
 /*
@@ -259,31 +622,29 @@ hopscotch_insert(struct hopscotch_hash_table *ht, void *key, void *data)
 void *
 hopscotch_remove(struct hopscotch_hash_table *ht, void *key)
 {
-#ifdef THREAD_SAFE
-    ASSERT(0);  /* use the _safe version */
-#endif
+    struct hopscotch_table *t = ht->table;
     uint32_t h;
     size_t idx;
     size_t i;
     size_t sz;
     void *data;
 
-    sz = 1ULL << ht->exponent;
-    h = _jenkins_hash(key,KEY_LEN);
+    sz = 1ULL << t->exponent;
+    h = _hash(key);
     idx = h & (sz - 1);
 
-    if ( !ht->buckets[idx].hopinfo ) {
+    if ( !t->buckets[idx].hopinfo ) {
         return NULL;
     }
     for ( i = 0; i < HOPSCOTCH_HOPINFO_SIZE; i++ ) {
-        if ( ht->buckets[idx].hopinfo & (1 << i) ) {
-            if ( 0 == memcmp(key, ht->buckets[idx + i].key, KEY_LEN) ) {
+        if ( t->buckets[idx].hopinfo & (1 << i) ) {
+            if ( 0 == memcmp(key, t->buckets[idx + i].key, KEY_LEN) ) {
                 /* Found */
-                data = ht->buckets[idx + i].data;
-                ht->buckets[idx].hopinfo &= ~(1ULL << i);
-                memset(ht->buckets[idx + i].key, 0, KEY_LEN);
-                ht->buckets[idx + i].data = NULL;
-                ht->buckets[i].taken = 0;
+                data = t->buckets[idx + i].data;
+                t->buckets[idx].hopinfo &= ~(1ULL << i);
+                memset(t->buckets[idx + i].key, 0, KEY_LEN);
+                t->buckets[idx + i].data = NULL;
+                t->buckets[idx + i].taken = 0;
                 return data;
             }
         }
@@ -292,26 +653,61 @@ hopscotch_remove(struct hopscotch_hash_table *ht, void *key)
     return NULL;
 }
 
+/*
+ * Resize the bucket size of the hash table
+ */
+int
+hopscotch_resize(struct hopscotch_hash_table *ht, int delta)
+{
+    struct hopscotch_table *ot, *nt;
+    size_t i;
+    int ret;
+
+    ot = ht->table;
+    nt = _table_alloc(ot->exponent + delta);
+    if ( NULL == nt ) {
+        return -1;
+    }
+    ht->table = nt;
+
+    for ( i = 0; i < (1ULL << ot->exponent) + HOPSCOTCH_ADD_RANGE; i++ ) {
+        if ( ot->buckets[i].taken ) {
+            ret = hopscotch_insert(ht, ot->buckets[i].key, ot->buckets[i].data);
+            if ( ret < 0 ) {
+                ht->table = ot;
+                _table_free(nt);
+                return -1;
+            }
+        }
+    }
+    _table_free(ot);
+
+    return 0;
+}
+
 #else
 
 /*
- * Lookup Thread-safe
+ * Lookup in one table, thread-safe
  */
-void *
-hopscotch_lookup(struct hopscotch_hash_table *ht, void *key, int *found)
+static void *
+_table_lookup(struct hopscotch_table *t, void *key, uint32_t h, int *found)
 {
-    uint32_t h, hopinfo, retries;
+    uint32_t hopinfo, retries;
     size_t idx, i, sz;
     bool lock, locked;
     uint64_t timestamp;
     struct hopscotch_bucket *bucket, *hop;
-    void* value;
+    uint8_t hopkey[KEY_LEN];
+    void *value, *hopdata;
 
     /* find bucket */
-    sz = 1ULL << ht->exponent;
-    h = _jenkins_hash(key,KEY_LEN);
+    sz = 1ULL << t->exponent;
     idx = h & (sz - 1);
-    bucket = &(ht->buckets[idx]);
+    bucket = &(t->buckets[idx]);
+#ifdef USE_FINGERPRINTS
+    uint8_t fp = _fingerprint(h);
+#endif
 
     /* try without locking a few times */
     lock = locked = false;
@@ -320,34 +716,41 @@ hopscotch_lookup(struct hopscotch_hash_table *ht, void *key, int *found)
     value = NULL;
     do {
         if (lock) {
-            MUTEX_LOCK(&bucket->rw_lock);
+            MUTEX_LOCK(ANCHOR_RW_LOCK(t, idx));
             locked = true;
         }
 
-        HINT_READ_FAULT(&(bucket->timestamp));
-        timestamp = load_acquire(&(bucket->timestamp)); /* fence */
-        hopinfo = bucket->hopinfo;
+        HINT_READ_FAULT(ANCHOR_TIMESTAMP(t, idx));
+        timestamp = load_acquire(ANCHOR_TIMESTAMP(t, idx)); /* fence */
+        hopinfo = load_acquire(&bucket->hopinfo);  /* before fingerprints */
+#ifdef USE_FINGERPRINTS
+        /* only look at hop buckets with a matching fingerprint. a stale
+         * fingerprint can only come from a concurrent insert, which
+         * either updates the timestamp or hasn't published the key yet */
         if (hopinfo) {
-            for ( i = 0; i < HOPSCOTCH_HOPINFO_SIZE; i++ ) {
-                if (hopinfo & (1 << i)) {
-                    /* read key-value atomically. TODO: how expensive is this? */
-                    hop = &(ht->buckets[idx + i]);
-                    bucket_data_lock(ht, idx + i, -1);
-                    if(0 == memcmp(key, hop->key, KEY_LEN)) {
-                        /* found */
-                        value = hop->data;
-                        *found = 1;
-                    }
-                    bucket_data_unlock(ht, idx + i, -1);
-                    if (*found)
-                        goto out;
-                }
+            HINT_READ_FAULT(&t->fingerprints[idx]);
+            hopinfo &= _fingerprint_match(&t->fingerprints[idx], fp);
+        }
+#endif
+        while (hopinfo) {
+            i = __builtin_ctz(hopinfo);
+            hopinfo &= (hopinfo - 1);
+
+            /* read key-value consistently, without locking */
+            hop = &(t->buckets[idx + i]);
+            bucket_data_read(hop, hopkey, &hopdata);
+            if(0 == memcmp(key, hopkey, KEY_LEN)) {
+                /* found */
+                value = hopdata;
+                *found = 1;
+                goto out;
             }
         }
 
-        /* if not under lock, we could have a race with insert() which  
+        /* if not under lock, we could have a race with insert() which
          * moved our hop-bucket during lookup, hence missing it */
-        if (timestamp == ACCESS_ONCE(bucket->timestamp)) {
+        smp_rmb();
+        if (timestamp == ACCESS_ONCE(*ANCHOR_TIMESTAMP(t, idx))) {
             /* we didn't miss anything, the key really wasn't there */
             value = NULL;
             goto out;
@@ -355,7 +758,7 @@ hopscotch_lookup(struct hopscotch_hash_table *ht, void *key, int *found)
 
         /* something changed the bucket while lookup */
         /* but this cannot happen under a lock */
-        ASSERT(!locked);    
+        ASSERT(!locked);
 
         /* keep trying without locking */
         if (retries++ < MAX_LOCKLESS_RETRIES)
@@ -366,255 +769,763 @@ hopscotch_lookup(struct hopscotch_hash_table *ht, void *key, int *found)
     } while(1);
 
 out:
-    if (locked) 
-        MUTEX_UNLOCK(&bucket->rw_lock);
+    if (locked)
+        MUTEX_UNLOCK(ANCHOR_RW_LOCK(t, idx));
     return value;
 }
 
-
 /*
- * Insert (or updates) an entry to the hash table, thread-safe
+ * Insert (or update) an entry in one table. Caller must hold the lock
+ * on the anchor _idx_. Returns -1 if there was no room for the entry
+ * within reach of the anchor, which calls for a bigger table
  */
-int
-hopscotch_insert(struct hopscotch_hash_table *ht, void *key, void *data)
+static int
+_table_insert_locked(struct hopscotch_table *t, size_t idx,
+        void *key, uint32_t h, void *data)
 {
-    uint32_t h, hopinfo;
-    size_t idx, i, sz, off, j, fromidx, toidx;
+    uint32_t hopinfo;
+    size_t i, off, j, fromidx, toidx;
     struct hopscotch_bucket *bucket, *hop;
     struct hopscotch_bucket *anchor, *from, *to;
-    bool marked, found;
-    int retval = 1;
-
-    sz = 1ULL << ht->exponent;
-    h = _jenkins_hash(key,KEY_LEN);
-    idx = h & (sz - 1);
-    bucket = &(ht->buckets[idx]);
+    MUTEX_T *anchor_lock;
+    bool marked, relock;
 
-    /* must lock */
-    MUTEX_LOCK(&bucket->rw_lock);
-    hopinfo = load_acquire(&(bucket->hopinfo)); 
+    bucket = &(t->buckets[idx]);
+    hopinfo = load_acquire(&(bucket->hopinfo));
 
     /* check if key already exists and if so, update */
-    if (hopinfo) {
-        found = false;
-        for ( i = 0; i < HOPSCOTCH_HOPINFO_SIZE; i++ ) {
-            if (hopinfo & (1 << i)) {
-                /* read and update key-value atomically. TODO: how expensive is this? */
-                hop = &(ht->buckets[idx + i]);
-                bucket_data_lock(ht, idx + i, -1);
-                if (0 == memcmp(key, hop->key, KEY_LEN)) {  
-                    /* found */
-                    hop->data = data; 
-                    found = true;
-                }
-                bucket_data_unlock(ht, idx + i, -1);
-                if (found) {
-                    retval = 0;
-                    pr_debug("replacing key %lu", (uint64_t)data);
-                    goto out;
-                }
-            }
+    while (hopinfo) {
+        i = __builtin_ctz(hopinfo);
+        hopinfo &= (hopinfo - 1);
+
+        /* hop buckets of a locked anchor cannot move, so we can
+         * read the key as is; only the update needs the lock */
+        hop = &(t->buckets[idx + i]);
+        if (0 == memcmp(key, hop->key, KEY_LEN)) {
+            /* found */
+            bucket_data_lock(t, idx + i, -1);
+            bucket_write_begin(hop);
+            hop->data = data;
+            bucket_write_end(hop);
+            bucket_data_unlock(t, idx + i, -1);
+            pr_debug("replacing key %lu", (uint64_t)data);
+            return 0;
         }
     }
 
     /* key not found, need to insert */
     /* probing to find an empty bucket */
     pr_debug("inserting key %lu (hash bucket: %ld)", (uint64_t)data, idx);
-    for ( i = idx; i < sz; i++ ) {
-        marked = atomic_cmpxchg(&ht->buckets[i].marked, 0, 1);
-        if (marked) {
-            /* found an available bucket */
-            pr_debug("inserting key %lu: found empty bucket %ld", (uint64_t)data, i);
-            while ( i - idx >= HOPSCOTCH_HOPINFO_SIZE ) {
-                /* but it is out of the hopscotch window; we need to move it up */
-                pr_debug("inserting key %lu: bucket out of hop window", (uint64_t)data);
-                toidx = i;
-                to = &(ht->buckets[toidx]);
-                for ( j = 1; j < HOPSCOTCH_HOPINFO_SIZE; j++ ) {
-                    /* for all buckets (anchors) for which the empty item 
-                     * falls within hop window... */
-                    anchor = &(ht->buckets[i - j]);
-                    if (!anchor->hopinfo) {
-                        continue;
-                    }
+    for ( i = idx; i < idx + HOPSCOTCH_ADD_RANGE; i++ ) {
+        marked = atomic_cmpxchg(&t->buckets[i].marked, 0, 1);
+        if (marked)
+            break;
+    }
+    if ( i >= idx + HOPSCOTCH_ADD_RANGE ) {
+        /* no empty bucket in range */
+        return -1;
+    }
 
-                    /* lock and recheck hopinfo */
-                    MUTEX_LOCK(&anchor->rw_lock);
-                    hopinfo = load_acquire(&(anchor->hopinfo)); 
-                    if (unlikely(!hopinfo)) {
-                        MUTEX_UNLOCK(&anchor->rw_lock);
-                        continue;
-                    }
+    /* found an available bucket */
+    pr_debug("inserting key %lu: found empty bucket %ld", (uint64_t)data, i);
+    while ( i - idx >= HOPSCOTCH_HOPINFO_SIZE ) {
+        /* but it is out of the hopscotch window; we need to move it up */
+        pr_debug("inserting key %lu: bucket out of hop window", (uint64_t)data);
+        toidx = i;
+        to = &(t->buckets[toidx]);
+        for ( j = 1; j < HOPSCOTCH_HOPINFO_SIZE; j++ ) {
+            /* for all buckets (anchors) for which the empty item
+             * falls within hop window... */
+            anchor = &(t->buckets[i - j]);
+            if (!anchor->hopinfo) {
+                continue;
+            }
 
-                    /* this anchor doesn't have an item that falls before 
-                     * our empty item and hence is not a candidate */
-                    off = __builtin_ctz(hopinfo);
-                    if ( off >= j ) {
-                        MUTEX_UNLOCK(&anchor->rw_lock);
-                        continue;
-                    }
+            /* lock and recheck hopinfo. with striped anchor locks,
+             * we may already be holding the anchor's lock */
+            anchor_lock = ANCHOR_RW_LOCK(t, i - j);
+            relock = (anchor_lock != ANCHOR_RW_LOCK(t, idx));
+            if (relock)
+                MUTEX_LOCK(anchor_lock);
+            hopinfo = load_acquire(&(anchor->hopinfo));
+            if (unlikely(!hopinfo)) {
+                if (relock)
+                    MUTEX_UNLOCK(anchor_lock);
+                continue;
+            }
 
-                    /* found a swappable item, move data */
-                    fromidx = i - j + off;
-                    from = &(ht->buckets[fromidx]);
-
-                    /* always take nested locks in top-down order */
-                    /* TODO: can we do without locking _to_? */
-
-                    bucket_data_lock(ht, fromidx, -1);
-                    bucket_data_lock(ht, toidx, fromidx);
-                    memcpy(to->key, from->key, KEY_LEN);
-                    to->data = from->data;
-                    // clearing _from_ values is not really necessary
-                    // memset(from.key, 0, KEY_LEN);
-                    // from.data = NULL;
-                    bucket_data_unlock(ht, toidx, -1);
-                    bucket_data_unlock(ht, fromidx, toidx);
-
-                    /* sanity check that _from_ was already marked */
-                    ASSERT(atomic_read(&from->marked) == 1);
-
-                    /* update hop pointers in anchor */
-                    anchor->hopinfo |= (1ULL << j);
-                    anchor->timestamp++;
-                    anchor->hopinfo &= ~(1ULL << off);
-                    MUTEX_UNLOCK(&anchor->rw_lock);
-
-                    /* jump backwards */
-                    i = i - j + off;
-                    break;
-                }
-                if ( j >= HOPSCOTCH_HOPINFO_SIZE ) {
-                    /* bucket is full and we need to resize the table,
-                     * error out for now */
-                    ASSERT(0);
-                }
+            /* this anchor doesn't have an item that falls before
+             * our empty item and hence is not a candidate */
+            off = __builtin_ctz(hopinfo);
+            if ( off >= j ) {
+                if (relock)
+                    MUTEX_UNLOCK(anchor_lock);
+                continue;
             }
 
-            /* an empty bucket in the hop window, insert */
+            /* found a swappable item, move data */
+            fromidx = i - j + off;
+            from = &(t->buckets[fromidx]);
 
-            pr_debug("inserting key %lu: at bucket %ld", (uint64_t)data, i);
-            off = i - idx;
-            to = &(ht->buckets[i]);
-            bucket_data_lock(ht, i, -1);
-            memcpy(to->key, key, KEY_LEN);
-            to->data = data;
-            bucket_data_unlock(ht, i, -1);
-            bucket->hopinfo |= (1ULL << off);
-
-            /* success */
-            retval = 0;
-            goto out;
+            /* always take nested locks in top-down order */
+            /* TODO: can we do without locking _to_? */
+
+            bucket_data_lock(t, fromidx, -1);
+            bucket_data_lock(t, toidx, fromidx);
+            bucket_write_begin(to);
+            memcpy(to->key, from->key, KEY_LEN);
+            to->data = from->data;
+#ifdef USE_FINGERPRINTS
+            t->fingerprints[toidx] = t->fingerprints[fromidx];
+#endif
+            bucket_write_end(to);
+            // clearing _from_ values is not really necessary
+            // memset(from.key, 0, KEY_LEN);
+            // from.data = NULL;
+            bucket_data_unlock(t, toidx, -1);
+            bucket_data_unlock(t, fromidx, toidx);
+
+            /* sanity check that _from_ was already marked */
+            ASSERT(atomic_read(&from->marked) == 1);
+
+            /* update hop pointers in anchor; lockless readers
+             * must see the new hop before the old one goes away */
+            anchor->hopinfo |= (1ULL << j);
+            smp_wmb();
+            (*ANCHOR_TIMESTAMP(t, i - j))++;
+            smp_wmb();
+            anchor->hopinfo &= ~(1ULL << off);
+            if (relock)
+                MUTEX_UNLOCK(anchor_lock);
+
+            /* jump backwards */
+            i = i - j + off;
+            break;
+        }
+        if ( j >= HOPSCOTCH_HOPINFO_SIZE ) {
+            /* nothing can be moved out of the way; give back the
+             * (possibly moved) empty bucket */
+            atomic_write(&t->buckets[i].marked, 0);
+            return -1;
         }
     }
-    /* need to resize the table, error out for now */
-    ASSERT(0);
 
-out:
-    pr_debug("done inserting key %lu", (uint64_t)data);
-    MUTEX_UNLOCK(&bucket->rw_lock);
-    pr_debug("done inserting key %lu", (uint64_t)data);
-    return retval;
+    /* an empty bucket in the hop window, insert */
+    pr_debug("inserting key %lu: at bucket %ld", (uint64_t)data, i);
+    off = i - idx;
+    to = &(t->buckets[i]);
+    bucket_data_lock(t, i, -1);
+    bucket_write_begin(to);
+    memcpy(to->key, key, KEY_LEN);
+    to->data = data;
+#ifdef USE_FINGERPRINTS
+    t->fingerprints[i] = _fingerprint(h);
+#endif
+    bucket_write_end(to);
+    bucket_data_unlock(t, i, -1);
+    smp_wmb();
+    bucket->hopinfo |= (1ULL << off);
+    return 0;
 }
 
 /*
- * Remove an item - thread-safe
+ * Remove an entry from one table. Caller must hold the lock on the
+ * anchor _idx_
  */
-void *
-hopscotch_remove(struct hopscotch_hash_table *ht, void *key)
+static void *
+_table_remove_locked(struct hopscotch_table *t, size_t idx, void *key)
 {
-    uint32_t h, hopinfo;
-    size_t idx, i, sz, off, j;
+    uint32_t hopinfo;
+    size_t i;
     struct hopscotch_bucket *bucket, *hop;
-    bool unmarked, found;
-    int retval = 1;
     void* value;
 
-    sz = 1ULL << ht->exponent;
-    h = _jenkins_hash(key,KEY_LEN);
-    idx = h & (sz - 1);
-    bucket = &(ht->buckets[idx]);
-
-    /* must lock */
-    MUTEX_LOCK(&bucket->rw_lock);
-    hopinfo = load_acquire(&(bucket->hopinfo)); 
+    bucket = &(t->buckets[idx]);
+    hopinfo = load_acquire(&(bucket->hopinfo));
 
     /* check if key exists and if so, clear the bucket */
-    value = NULL;
-    if (hopinfo) {
-        found = false;
-        for ( i = 0; i < HOPSCOTCH_HOPINFO_SIZE; i++ ) {
-            if (hopinfo & (1 << i)) {
-                /* read and update key-value atomically. TODO: how expensive is this? */
-                hop = &(ht->buckets[idx + i]);
-                bucket_data_lock(ht, idx + i, -1);
-                if (0 == memcmp(key, hop->key, KEY_LEN)) {  
-                    /* found */
-                    value = hop->data;
-                    found = true;
-                }
-                bucket_data_unlock(ht, idx + i, -1);
-                if (found) {
-                    hop->hopinfo &= ~(1ULL << i);       /* unlink the bucket */
-                    ASSERT(atomic_read(&hop->marked));
-                    atomic_write(&hop->marked, 0);      /* mark it available */
-                    goto out;
-                }
-            }
+    while (hopinfo) {
+        i = __builtin_ctz(hopinfo);
+        hopinfo &= (hopinfo - 1);
+
+        /* hop buckets of a locked anchor cannot move */
+        hop = &(t->buckets[idx + i]);
+        if (0 == memcmp(key, hop->key, KEY_LEN)) {
+            /* found */
+            value = hop->data;
+            bucket->hopinfo &= ~(1ULL << i);    /* unlink the bucket */
+            smp_wmb();
+            bucket_data_lock(t, idx + i, -1);
+            bucket_write_begin(hop);
+            memset(hop->key, 0, KEY_LEN);
+            hop->data = NULL;
+            bucket_write_end(hop);
+            bucket_data_unlock(t, idx + i, -1);
+            ASSERT(atomic_read(&hop->marked));
+            atomic_write(&hop->marked, 0);      /* mark it available */
+            return value;
         }
     }
+    return NULL;
+}
 
-out:
-    MUTEX_UNLOCK(&bucket->rw_lock);
-    return value;
+/*
+ * Online resize. Growing the table swaps in a bigger bucket array and
+ * keeps the old one around until all its entries are moved over. Every
+ * writer first moves the entries of its own anchor in the old table (so
+ * that a key is never in both tables with different values) and then
+ * helps with migrating a chunk of anchors, so no single request pays
+ * for the whole copy. Readers check the old table, then the new one;
+ * _resize_seq_ tells them if the tables changed under a miss.
+ *
+ * A migrating entry may still find no room in the new table, e.g., when
+ * writers fill it faster than the old one drains or when its anchors are
+ * clustered. The new table then joins the old one in the list of tables
+ * being migrated (oldest first) and both drain into a table twice as big.
+ * Entries only ever move from older to newer tables, so readers that go
+ * through the list in order still cannot miss them.
+ */
+
+/* consistent view of the current and old tables */
+static __inline__ uint32_t
+_tables_snapshot(struct hopscotch_hash_table *ht,
+        struct hopscotch_table **old, struct hopscotch_table **cur)
+{
+    uint32_t seq;
+    while (1) {
+        seq = load_acquire(&ht->resize_seq);
+        if (unlikely(seq & 1)) {
+            /* tables being swapped */
+            cpu_relax();
+            continue;
+        }
+        *old = ACCESS_ONCE(ht->old);
+        *cur = ACCESS_ONCE(ht->table);
+        smp_rmb();
+        if (likely(seq == ACCESS_ONCE(ht->resize_seq)))
+            return seq;
+    }
 }
 
+static __inline__ void
+_resize_wait(void)
+{
+#ifdef SHENANGO
+    /* let the thread that is migrating run */
+    thread_yield();
+#else
+    cpu_relax();
 #endif
+}
+
+/* move entries of an old anchor to the new table, with the old anchor
+ * locked. entries leave the old table only after they are visible in
+ * the new one so lockless readers (old first, then new) always see them.
+ * returns -1 if the new table had no room for an entry and 1 if it was
+ * retired in the meantime; entries not moved stay in the old table */
+static int
+_migrate_anchor(struct hopscotch_hash_table *ht, struct hopscotch_table *old,
+        struct hopscotch_table *cur, size_t idx)
+{
+    uint32_t hopinfo, h;
+    size_t i, nidx;
+    struct hopscotch_bucket *anchor, *hop;
+    uint8_t key[KEY_LEN];
+    int ret;
+
+    anchor = &(old->buckets[idx]);
+    hopinfo = load_acquire(&(anchor->hopinfo));
+    while (hopinfo) {
+        i = __builtin_ctz(hopinfo);
+        hopinfo &= (hopinfo - 1);
+
+        hop = &(old->buckets[idx + i]);
+        memcpy(key, hop->key, KEY_LEN);
+        h = _hash(key);
+        nidx = h & ((1ULL << cur->exponent) - 1);
+        MUTEX_LOCK(ANCHOR_RW_LOCK(cur, nidx));
+        if (unlikely(ACCESS_ONCE(ht->table) != cur)) {
+            /* _cur_ became an old table and this anchor may have been
+             * migrated out of it already */
+            MUTEX_UNLOCK(ANCHOR_RW_LOCK(cur, nidx));
+            return 1;
+        }
+        ret = _table_insert_locked(cur, nidx, key, h, hop->data);
+        MUTEX_UNLOCK(ANCHOR_RW_LOCK(cur, nidx));
+        if (ret)
+            return -1;
+
+        smp_wmb();
+        anchor->hopinfo &= ~(1ULL << i);
+    }
+    return 0;
+}
+
+/* swap in a bigger table and start migrating _cur_ into it, unless some
+ * other thread already did. Caller must hold the resize lock */
+static void
+_resize_start(struct hopscotch_hash_table *ht, struct hopscotch_table *cur,
+        int delta)
+{
+    struct hopscotch_table *t, **tail;
+
+    if (ht->table != cur)
+        return;
+    t = _table_alloc(cur->exponent + delta);
+    if (NULL == t) {
+        pr_err("failed to allocate hash table for resize");
+        ASSERT(0);
+    }
+    for (tail = &ht->old; *tail; tail = &(*tail)->next_old)
+        ;
+    cur->next_old = NULL;
+    ACCESS_ONCE(ht->resize_seq) = ht->resize_seq + 1;
+    smp_wmb();
+    ACCESS_ONCE(*tail) = cur;
+    ACCESS_ONCE(ht->table) = t;
+    smp_wmb();
+    ACCESS_ONCE(ht->resize_seq) = ht->resize_seq + 1;
+    pr_info("resizing hash table to 2^%lu buckets", t->exponent);
+}
+
+/* done with migration: retire the old table */
+static void
+_resize_finish(struct hopscotch_hash_table *ht, struct hopscotch_table *old)
+{
+    struct hopscotch_table **prev;
+
+    MUTEX_LOCK(&ht->resize_lock);
+    for (prev = &ht->old; *prev != old; prev = &(*prev)->next_old)
+        ASSERT(*prev);
+    ACCESS_ONCE(ht->resize_seq) = ht->resize_seq + 1;
+    smp_wmb();
+    ACCESS_ONCE(*prev) = old->next_old;
+    smp_wmb();
+    ACCESS_ONCE(ht->resize_seq) = ht->resize_seq + 1;
+    /* lookups may still be reading it; freed in hopscotch_reclaim() */
+    old->next_retired = ht->retired;
+    ht->retired = old;
+    MUTEX_UNLOCK(&ht->resize_lock);
+    pr_debug("hash table resize done");
+}
+
+/* move an old anchor into whatever the current table is, growing the
+ * table further if it runs out of room */
+static void
+_resize_migrate_anchor(struct hopscotch_hash_table *ht,
+        struct hopscotch_table *old, size_t idx)
+{
+    struct hopscotch_table *first, *cur;
+    int ret;
+
+    do {
+        _tables_snapshot(ht, &first, &cur);
+        /* must lock even to check: a writer that got in just before
+         * the resize may still be inserting into this anchor */
+        MUTEX_LOCK(ANCHOR_RW_LOCK(old, idx));
+        ret = _migrate_anchor(ht, old, cur, idx);
+        MUTEX_UNLOCK(ANCHOR_RW_LOCK(old, idx));
+        if (ret < 0) {
+            /* no room in the new table, migrate it too */
+            MUTEX_LOCK(&ht->resize_lock);
+            if (ht->table == cur)
+                pr_info("no room in the new table while resizing");
+            _resize_start(ht, cur, 1);
+            MUTEX_UNLOCK(&ht->resize_lock);
+        }
+    } while (ret);
+}
+
+/* migrate the next chunk of anchors of some old table, if any. 
+ * migration state lives in the old table so that a stale helper can 
+ * never count towards a later resize. returns false if there was 
+ * nothing left to pick up */
+static bool
+_resize_help(struct hopscotch_hash_table *ht)
+{
+    struct hopscotch_table *old, *cur;
+    size_t sz, nchunks, chunk, idx, end;
+
+    _tables_snapshot(ht, &old, &cur);
+    for (; old; old = ACCESS_ONCE(old->next_old)) {
+        sz = 1ULL << old->exponent;
+        nchunks = (sz + HOPSCOTCH_MIGRATE_CHUNK - 1) / HOPSCOTCH_MIGRATE_CHUNK;
+        if (atomic_read(&old->migrate_next) >= (int) nchunks)
+            continue;
+        chunk = atomic_fetch_and_add(&old->migrate_next, 1);
+        if (chunk < nchunks)
+            break;
+    }
+    if (!old)
+        return false;
+
+    end = min((chunk + 1) * HOPSCOTCH_MIGRATE_CHUNK, sz);
+    for (idx = chunk * HOPSCOTCH_MIGRATE_CHUNK; idx < end; idx++)
+        _resize_migrate_anchor(ht, old, idx);
+
+    if (atomic_fetch_and_add(&old->migrate_done, 1) + 1 == (int) nchunks)
+        _resize_finish(ht, old);
+    return true;
+}
+
+/* migrate the old anchors of a key before writing it in the new table */
+static __inline__ void
+_resize_migrate_key(struct hopscotch_hash_table *ht,
+        struct hopscotch_table *old, uint32_t h)
+{
+    for (; old; old = ACCESS_ONCE(old->next_old))
+        _resize_migrate_anchor(ht, old, h & ((1ULL << old->exponent) - 1));
+}
+
+/* grow the table if _cur_ is still the current one. only one migration
+ * is allowed at a time so first help finish the ongoing one, if any */
+static void
+_resize_grow(struct hopscotch_hash_table *ht, struct hopscotch_table *cur,
+        int delta)
+{
+    struct hopscotch_table *old, *now;
+
+    while (1) {
+        _tables_snapshot(ht, &old, &now);
+        if (now != cur)
+            /* someone else already grew it */
+            return;
+        if (!old)
+            break;
+        if (!_resize_help(ht))
+            _resize_wait();
+    }
+
+    MUTEX_LOCK(&ht->resize_lock);
+    if (ht->old == NULL)
+        _resize_start(ht, cur, delta);
+    MUTEX_UNLOCK(&ht->resize_lock);
+}
 
 /*
- * Resize the bucket size of the hash table
+ * Lookup Thread-safe
+ */
+void *
+hopscotch_lookup(struct hopscotch_hash_table *ht, void *key, int *found)
+{
+    uint32_t h, seq;
+    struct hopscotch_table *old, *cur;
+    void *value;
+
+    h = _hash(key);
+    do {
+        seq = _tables_snapshot(ht, &old, &cur);
+        for (; unlikely(old != NULL); old = ACCESS_ONCE(old->next_old)) {
+            value = _table_lookup(old, key, h, found);
+            if (*found)
+                return value;
+        }
+        value = _table_lookup(cur, key, h, found);
+        if (*found)
+            return value;
+
+        /* a resize that started in the meantime may have moved the
+         * key out of our view, look again */
+        smp_rmb();
+    } while (seq != ACCESS_ONCE(ht->resize_seq));
+    return NULL;
+}
+
+/* start bringing in a memory location without waiting for it */
+static __inline__ void
+_prefetch(void *addr)
+{
+    __builtin_prefetch(addr);
+    HINT_READ_FAULT(addr);
+}
+
+/*
+ * Batched lookup, thread-safe. Looks up _n_ keys with their memory
+ * stalls overlapped rather than paid back to back: hashes all keys and
+ * prefetches (or hints faults on) their anchors first, then prefetches
+ * the candidate hop buckets, and resolves each key last when its data
+ * is hopefully local. Returns the number of keys found
  */
 int
-hopscotch_resize(struct hopscotch_hash_table *ht, int delta)
+hopscotch_lookup_batch(struct hopscotch_hash_table *ht, void **keys, int n,
+        void **values, int *found)
 {
-    size_t sz;
-    size_t oexp;
-    size_t nexp;
-    ssize_t i;
-    struct hopscotch_bucket *nbuckets;
-    struct hopscotch_bucket *obuckets;
-    int ret;
+    uint32_t h[HOPSCOTCH_LOOKUP_BATCH], hopinfo, seq;
+    size_t idx[HOPSCOTCH_LOOKUP_BATCH], sz;
+    struct hopscotch_table *old, *cur;
+    int i, k, batch, nfound = 0;
+
+    for (k = 0; k < n; k += batch) {
+        batch = min(n - k, HOPSCOTCH_LOOKUP_BATCH);
+
+        seq = _tables_snapshot(ht, &old, &cur);
+        if (unlikely(old != NULL)) {
+            /* mid-resize, keys may be in either table */
+            for (i = k; i < k + batch; i++) {
+                values[i] = hopscotch_lookup(ht, keys[i], &found[i]);
+                nfound += found[i];
+            }
+            continue;
+        }
 
-    oexp = ht->exponent;
-    nexp = ht->exponent + delta;
-    sz = 1ULL << nexp;
+        /* stage 1: hash and fetch anchors */
+        sz = 1ULL << cur->exponent;
+        for (i = 0; i < batch; i++) {
+            h[i] = _hash(keys[k + i]);
+            idx[i] = h[i] & (sz - 1);
+            _prefetch(&cur->buckets[idx[i]]);
+#ifdef COMPACT_BUCKETS
+            _prefetch(ANCHOR_TIMESTAMP(cur, idx[i]));
+#endif
+#ifdef USE_FINGERPRINTS
+            _prefetch(&cur->fingerprints[idx[i]]);
+#endif
+        }
 
-    nbuckets = malloc(sizeof(struct hopscotch_bucket) * sz);
-    if ( NULL == nbuckets ) {
-        return -1;
+        /* stage 2: fetch candidate hop buckets. this is only a hint,
+         * so a racy read of the anchor is fine */
+        for (i = 0; i < batch; i++) {
+            hopinfo = ACCESS_ONCE(cur->buckets[idx[i]].hopinfo);
+#ifdef USE_FINGERPRINTS
+            if (hopinfo)
+                hopinfo &= _fingerprint_match(&cur->fingerprints[idx[i]],
+                    _fingerprint(h[i]));
+#endif
+            while (hopinfo) {
+                _prefetch(&cur->buckets[idx[i] + __builtin_ctz(hopinfo)]);
+                hopinfo &= (hopinfo - 1);
+            }
+        }
+
+        /* stage 3: resolve */
+        for (i = 0; i < batch; i++)
+            values[k + i] = _table_lookup(cur, keys[k + i], h[i], &found[k + i]);
+
+        /* same as hopscotch_lookup(), misses are only final if the
+         * tables didn't change in the meantime */
+        smp_rmb();
+        for (i = k; i < k + batch; i++) {
+            if (!found[i] && seq != ACCESS_ONCE(ht->resize_seq))
+                values[i] = hopscotch_lookup(ht, keys[i], &found[i]);
+            nfound += found[i];
+        }
     }
-    memset(nbuckets, 0, sizeof(struct hopscotch_bucket) * sz);
-    obuckets = ht->buckets;
+    return nfound;
+}
 
-    ht->buckets = nbuckets;
-    ht->exponent = nexp;
+/*
+ * Insert (or updates) an entry to the hash table, thread-safe
+ */
+int
+hopscotch_insert(struct hopscotch_hash_table *ht, void *key, void *data)
+{
+    uint32_t h, seq;
+    size_t idx;
+    struct hopscotch_table *old, *cur;
+    int ret;
 
-    for ( i = 0; i < (1LL << oexp); i++ ) {
-        if ( obuckets[i].key ) {
-            ret = hopscotch_insert(ht, obuckets[i].key, obuckets[i].data);
-            if ( ret < 0 ) {
-                ht->buckets = obuckets;
-                ht->exponent = oexp;
-                free(nbuckets);
-                return -1;
-            }
+    h = _hash(key);
+    while (1) {
+        seq = _tables_snapshot(ht, &old, &cur);
+        if (unlikely(old != NULL))
+            _resize_migrate_key(ht, old, h);
+
+        /* must lock */
+        idx = h & ((1ULL << cur->exponent) - 1);
+        MUTEX_LOCK(ANCHOR_RW_LOCK(cur, idx));
+        if (unlikely(seq != ACCESS_ONCE(ht->resize_seq))) {
+            /* tables changed before we got the lock */
+            MUTEX_UNLOCK(ANCHOR_RW_LOCK(cur, idx));
+            continue;
         }
+        ret = _table_insert_locked(cur, idx, key, h, data);
+        MUTEX_UNLOCK(ANCHOR_RW_LOCK(cur, idx));
+        pr_debug("done inserting key %lu", (uint64_t)data);
+        if (likely(ret == 0))
+            break;
+
+        /* no room in the neighborhood, grow the table and retry */
+        _resize_grow(ht, cur, 1);
     }
-    free(obuckets);
 
+    /* pay for a part of the ongoing migration */
+    if (unlikely(old != NULL))
+        _resize_help(ht);
     return 0;
 }
 
+/*
+ * Remove an item - thread-safe
+ */
+void *
+hopscotch_remove(struct hopscotch_hash_table *ht, void *key)
+{
+    uint32_t h, seq;
+    size_t idx;
+    struct hopscotch_table *old, *cur;
+    void* value;
+
+    h = _hash(key);
+    while (1) {
+        seq = _tables_snapshot(ht, &old, &cur);
+        if (unlikely(old != NULL))
+            _resize_migrate_key(ht, old, h);
+
+        /* must lock */
+        idx = h & ((1ULL << cur->exponent) - 1);
+        MUTEX_LOCK(ANCHOR_RW_LOCK(cur, idx));
+        if (likely(seq == ACCESS_ONCE(ht->resize_seq)))
+            break;
+        /* tables changed before we got the lock */
+        MUTEX_UNLOCK(ANCHOR_RW_LOCK(cur, idx));
+    }
+    value = _table_remove_locked(cur, idx, key);
+    MUTEX_UNLOCK(ANCHOR_RW_LOCK(cur, idx));
+
+    /* pay for a part of the ongoing migration */
+    if (unlikely(old != NULL))
+        _resize_help(ht);
+    return value;
+}
+
+/*
+ * Resize the bucket size of the hash table, thread-safe. Only grows
+ * the table (delta > 0); returns once all entries are migrated
+ */
+int
+hopscotch_resize(struct hopscotch_hash_table *ht, int delta)
+{
+    struct hopscotch_table *old, *cur;
+
+    if ( delta <= 0 ) {
+        return -1;
+    }
+
+    _tables_snapshot(ht, &old, &cur);
+    _resize_grow(ht, cur, delta);
+    while (1) {
+        _tables_snapshot(ht, &old, &cur);
+        if (!old)
+            break;
+        if (!_resize_help(ht))
+            _resize_wait();
+    }
+    return 0;
+}
+
+/*
+ * Multi-threaded stress test: workers insert, look up and remove
+ * interleaved shares of the synthetic app's keys on a table that starts
+ * small, so that inserts race with several online resizes
+ */
+struct _stress_args {
+    struct hopscotch_hash_table *ht;
+    int id;
+    int nworkers;
+    size_t nkeys;
+    atomic_t *errors;
+    WAITGROUP_T *wg;
+};
+
+static void
+_stress_key(uint8_t *key, size_t i)
+{
+    memset(key, 0xff, KEY_LEN);
+    *(uint32_t*)key = i;
+}
+
+#ifdef SHENANGO
+static void
+#else
+static void *
+#endif
+_stress_worker(void *arg)
+{
+    struct _stress_args *a = arg;
+    struct syn_rand_state rs;
+    uint8_t key[KEY_LEN];
+    size_t i, j, errors = 0;
+    void *value;
+    int found;
+
+    ASSERTZ(syn_rand_seed(&rs, a->id + 1));
+    for ( i = a->id; i < a->nkeys; i += a->nworkers ) {
+        _stress_key(key, i);
+        if ( hopscotch_insert(a->ht, key, (void *)(i + 1)) )
+            errors++;
+        /* own keys must never go missing, others' may not be in yet */
+        j = syn_rand_next(&rs) % (i + 1);
+        _stress_key(key, j);
+        value = hopscotch_lookup(a->ht, key, &found);
+        if ( found ? (value != (void *)(j + 1))
+                : (j % a->nworkers == (size_t) a->id) )
+            errors++;
+    }
+    /* remove a third of the keys */
+    for ( i = a->id; i < a->nkeys; i += a->nworkers ) {
+        if ( i % 3 )
+            continue;
+        _stress_key(key, i);
+        if ( hopscotch_remove(a->ht, key) != (void *)(i + 1) )
+            errors++;
+    }
+
+    if ( errors )
+        pr_err("stress worker %d: %lu errors", a->id, errors);
+    atomic_fetch_and_add(a->errors, errors);
+    WAITGROUP_ADD((*a->wg), -1);
+#ifndef SHENANGO
+    return NULL;
+#endif
+}
+
+int
+hopscotch_stress_test(int nworkers, size_t nkeys)
+{
+    struct hopscotch_hash_table *ht;
+    struct _stress_args *args;
+    THREAD_T *workers;
+    WAITGROUP_T wg;
+    atomic_t errors = ATOMIC_INIT(0);
+    uint8_t key[KEY_LEN];
+    size_t i, exponent;
+    void *value;
+    int found, j;
+
+    ht = hopscotch_init(NULL, HOPSCOTCH_INIT_BSIZE_EXPONENT);
+    workers = malloc(sizeof(THREAD_T) * nworkers);
+    args = malloc(sizeof(struct _stress_args) * nworkers);
+    ASSERT(ht && workers && args);
+
+    WAITGROUP_INIT(wg);
+    for ( j = 0; j < nworkers; j++ ) {
+        args[j] = (struct _stress_args) {ht, j, nworkers, nkeys, &errors, &wg};
+        WAITGROUP_ADD(wg, 1);
+        ASSERTZ(THREAD_CREATE(&workers[j], _stress_worker, &args[j]));
+    }
+    WAITGROUP_WAIT(wg);
+
+    /* a migration may still be in progress, check with lookups */
+    for ( i = 0; i < nkeys; i++ ) {
+        _stress_key(key, i);
+        value = hopscotch_lookup(ht, key, &found);
+        if ( found != !!(i % 3) || (found && value != (void *)(i + 1)) )
+            atomic_fetch_and_add(&errors, 1);
+    }
+    exponent = ht->table->exponent;
+    pr_info("hash stress test: %d workers, %lu keys, 2^%d -> 2^%lu buckets, "
+        "%d errors", nworkers, nkeys, HOPSCOTCH_INIT_BSIZE_EXPONENT,
+        exponent, atomic_read(&errors));
+
+    hopscotch_release(ht);
+    free(workers);
+    free(args);
+    return (atomic_read(&errors) || exponent <= HOPSCOTCH_INIT_BSIZE_EXPONENT)
+        ? -1 : 0;
+}
+
+#endif
+
 /*
  * Local variables:
  * tab-width: 4
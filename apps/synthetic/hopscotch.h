@@ -29,8 +29,8 @@
 #include "common.h"
 
 /* NOTE: only dataplane operations are thread-safe i.e., 
- * insert/lookup/remove. Anything that affects the table 
- * itself (e.g., init, resize, release) is not. */
+ * insert/lookup/remove and resize. Anything that affects the 
+ * table itself (e.g., init, reclaim, release) is not. */
 #define THREAD_SAFE
 
 /* Initial size of buckets.  2 to the power of this value will be allocated. */
@@ -39,40 +39,116 @@
 #define HOPSCOTCH_HOPINFO_SIZE          32
 #define KEY_LEN                         12
 #define MAX_LOCKLESS_RETRIES            2
+/* Max probe distance for an empty bucket on insert; also the number of 
+ * overflow buckets past the end of the table so probing never wraps. 
+ * Inserts that cannot find room within this range grow the table */
+#define HOPSCOTCH_ADD_RANGE             512
+/* Anchors migrated at a time (by any writer) during an online resize */
+#define HOPSCOTCH_MIGRATE_CHUNK         1024
+/* Max keys whose memory accesses are overlapped in a batched lookup */
+#define HOPSCOTCH_LOOKUP_BATCH          16
+
+/* keep a 1-byte hash fingerprint per bucket in a separate array so that
+ * a neighborhood can be filtered with one vector compare before comparing
+ * full keys (uses AVX2 when built for it, SSE2 otherwise) */
+#define USE_FINGERPRINTS
 
 // #define LOCK_INSIDE_BUCKET
 #ifndef BUCKETS_PER_LOCK
 #define BUCKETS_PER_LOCK                10000
 #endif
 
+/* Compact layout: pack only key, value and hop info into 32-byte buckets 
+ * (two per cache line, page-aligned) and keep the per-anchor locks and 
+ * timestamps in a separate, striped array. Touches far fewer cache lines
+ * (and pages) per lookup at the cost of some false sharing among writers */
+// #define COMPACT_BUCKETS
+#ifndef BUCKETS_PER_ANCHOR_LOCK
+#define BUCKETS_PER_ANCHOR_LOCK         64
+#endif
+#if defined(COMPACT_BUCKETS) && defined(LOCK_INSIDE_BUCKET)
+#error "LOCK_INSIDE_BUCKET is not supported with COMPACT_BUCKETS"
+#endif
+
 /*
  * Buckets
  */
+#ifdef COMPACT_BUCKETS
+struct hopscotch_bucket {
+    uint8_t key[KEY_LEN];
+    uint32_t hopinfo;
+    void* data;
+#ifdef THREAD_SAFE
+    /* see below */
+    uint32_t seq;
+    atomic_t marked;
+#else
+    uint8_t taken;
+#endif
+} __attribute__ ((aligned (32)));
+
+/* per-anchor synchronization, shared by BUCKETS_PER_ANCHOR_LOCK anchors */
+struct hopscotch_anchor_lock {
+    MUTEX_T rw_lock;
+    uint64_t timestamp;
+} __attribute__ ((aligned (64)));
+#else
 struct hopscotch_bucket {
     uint8_t key[KEY_LEN];
     uint8_t taken;
     void* data;
     uint32_t hopinfo;
 #ifdef THREAD_SAFE
+    /* sequence counter for key-value data; odd while a writer is in
+     * the middle of an update. lets readers go without locking */
+    uint32_t seq;
     /* coarse-grained lock to synchronize read-write and write-writes
      * used rarely by readers. yields to other threads if not available */
     MUTEX_T rw_lock;    
-    /* very fine-grained lock to make reading/writing kv-data atomic 
-     * as they're bigger than what built-in atomics can handle */
-    SPINLOCK_T kv_lock;    
+    /* very fine-grained lock to serialize writers of kv-data (readers
+     * use the sequence counter instead) */
+    SPINLOCK_T kv_lock;
     uint64_t timestamp;
     atomic_t marked;
 #endif
 } __attribute__ ((aligned (8)));
+#endif
 
 /*
- * Hash table of hopscotch hashing
+ * Bucket array of one size, along with its locks
  */
-struct hopscotch_hash_table {
+struct hopscotch_table {
     size_t exponent;
     struct hopscotch_bucket *buckets;
-    int _allocated;
     SPINLOCK_T* kv_locks;
+#ifdef USE_FINGERPRINTS
+    uint8_t *fingerprints;
+#endif
+#ifdef COMPACT_BUCKETS
+    struct hopscotch_anchor_lock* anchor_locks;
+    void* _buckets_mem;     /* unaligned allocation behind buckets */
+#endif
+    /* migration state when this table is being resized out of */
+    atomic_t migrate_next;  /* next chunk of anchors to migrate */
+    atomic_t migrate_done;  /* chunks of anchors migrated */
+    struct hopscotch_table *next_old;   /* next newer table being migrated */
+    struct hopscotch_table *next_retired;
+};
+
+/*
+ * Hash table of hopscotch hashing. Resizing allocates a bigger table 
+ * and moves entries over incrementally while the old one still serves 
+ * requests; lookups check both until the migration is done. If the new
+ * table runs out of room mid-migration, it is retired along with the
+ * old one into an even bigger table, so there may be a few old tables
+ */
+struct hopscotch_hash_table {
+    struct hopscotch_table *table;      /* current table */
+    struct hopscotch_table *old;        /* oldest table being migrated */
+    uint32_t resize_seq;                /* odd while the above change */
+    MUTEX_T resize_lock;
+    struct hopscotch_table *retired;    /* migrated tables, not yet freed */
+    int _allocated;
 };
 
 #ifdef __cplusplus
@@ -84,9 +160,14 @@ extern "C" {
     hopscotch_init(struct hopscotch_hash_table *, size_t);
     void hopscotch_release(struct hopscotch_hash_table *);
     void * hopscotch_lookup(struct hopscotch_hash_table *, void *, int*);
+    int hopscotch_lookup_batch(struct hopscotch_hash_table *, void **, int,
+        void **, int *);
     int hopscotch_insert(struct hopscotch_hash_table *, void *, void *);
     void * hopscotch_remove(struct hopscotch_hash_table *, void *);
     int hopscotch_resize(struct hopscotch_hash_table *, int);
+    void hopscotch_reclaim(struct hopscotch_hash_table *);
+    int hopscotch_hash_test(size_t);
+    int hopscotch_stress_test(int, size_t);
 
 #ifdef __cplusplus
 }
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
+#include <sys/uio.h>
 
 #include "aes.h"
 #include "common.h"
@@ -12,8 +13,8 @@
 #include "zipf.h"
 
 #define MEM_REGION_SIZE 	((1ull<<30) * 32)	// 32 GB
-#define NUM_LAT_SAMPLES 	5000
 #define BLOB_SIZE 			((unsigned long)2*PAGE_SIZE)
+#define BLOB_PAGES			(BLOB_SIZE / PAGE_SIZE)
 #define AES_KEY_SIZE 		128
 #ifndef KEYS_PER_REQ
 #define KEYS_PER_REQ 		1
@@ -24,31 +25,21 @@
 #define MIN min
 #endif
 
-/* these decide how long the experiment runs and how many 
- * requests to generate. Adjust maximum expected performance 
- * per core (MAX_OPS_PER_CORE) appropriately to generate 
- * enough requests to last for both the warmup (WARMUP_SECS) 
- * and the run (MIN_RUNTIME_SECS) but not spend too much time
- * in generating the workload */
+/* these decide how long the experiment runs. requests are 
+ * generated on the fly so runs are only bounded by time */
 #define MILLION				1000000
-#define MAX_OPS_PER_CORE	(10*MILLION)			
-// #define MAX_OPS_PER_CORE	10000			
 #define WARMUP_SECS 		30	
 #define MIN_RUNTIME_SECS 	5	
 #define MAX_RUNTIME_SECS 	30
-#ifdef DEBUG2
-#undef MAX_OPS_PER_CORE
-#define MAX_OPS_PER_CORE	10	
-#endif
 
 struct thread_args {
     int tid;
 	unsigned long nkeys;
 	unsigned long nblobs;
-	unsigned long nreqs;
 	unsigned long start;
 	unsigned long len;
 	unsigned long xput;
+	struct lat_hist* lat;
 	uint32_t pad[2];
 };
 typedef struct thread_args thread_args_t;
@@ -59,8 +50,8 @@ struct main_args {
 	int nworkers;
 	int nkeys;
 	int nblobs;
-	unsigned long nreqs;
 	double zparams;
+	double load;
 };
 
 uint64_t CYCLES_PER_US;
@@ -69,9 +60,12 @@ BARRIER_T ready, warmup, warmedup, start;
 int stop_button = 0;
 struct hopscotch_hash_table *ht;
 void* blobdata;
-uint64_t* zipf_sequence;
+struct zipf_sampler zipf;		/* shared, read-only */
+#ifdef ZIPF_TABLE
+ZIPFIAN zipf_table;				/* shared, read-only */
+#endif
 uint32_t* zipf_counts;
-double zparams;
+double worker_rate;		/* open-loop arrivals per µs per worker */
 WORD aes_ksched[60];
 BYTE aes_iv[16] = {
 	0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,
@@ -84,6 +78,38 @@ BYTE aes_key[32] = {
 	0x2d,0x98,0x10,0xa3,0x09,0x14,0xdf,0xf4
 };
 
+/* blob storage. a blob's pages are contiguous by default; with 
+ * BLOB_SCATTER page i of every blob lives in the i-th stripe of the 
+ * array instead, so no two pages of a blob are virtually adjacent 
+ * (like blobs assembled from page-granular far-memory allocations) */
+static inline void* blob_page(unsigned long blob, unsigned long nblobs, 
+		unsigned long page) {
+#ifdef BLOB_SCATTER
+	return blobdata + (page * nblobs + blob) * PAGE_SIZE;
+#else
+	return blobdata + blob * BLOB_SIZE + page * PAGE_SIZE;
+#endif
+}
+
+/* page-granular iovecs for a blob, with virtually contiguous pages 
+ * merged into one entry; returns the number of entries */
+static inline int blob_iov(unsigned long blob, unsigned long nblobs, 
+		struct iovec* iov) {
+	int i, n = 0;
+	void* page;
+	for (i = 0; i < BLOB_PAGES; i++) {
+		page = blob_page(blob, nblobs, i);
+		if (n > 0 && iov[n-1].iov_base + iov[n-1].iov_len == page) {
+			iov[n-1].iov_len += PAGE_SIZE;
+			continue;
+		}
+		iov[n].iov_base = page;
+		iov[n].iov_len = PAGE_SIZE;
+		n++;
+	}
+	return n;
+}
+
 /* save a number to a file */
 void fwrite_number(char* name, unsigned long number) {
 	FILE* fp = fopen(name, "w");
@@ -155,8 +181,9 @@ setup_blobs(void* arg) {
 				repeat = syn_rand_next(&rand) % 100;
 				rand_num = syn_rand_next(&rand);
 			}
-			offset = (targs->start + i) * BLOB_SIZE + j*sizeof(uint64_t);
-			*(uint64_t*)(blobdata + offset) = rand_num;
+			offset = j * sizeof(uint64_t);
+			*(uint64_t*)(blob_page(targs->start + i, targs->nblobs, 
+				offset / PAGE_SIZE) + offset % PAGE_SIZE) = rand_num;
 			repeat--;
 		}
 	}
@@ -178,32 +205,15 @@ static inline void thread_yield_after(int time_us, unsigned long* state) {
 #endif
 }
 
-/* prepare zipf workload */
+/* wait until the given time (for an open-loop arrival) */
+static inline void wait_until(uint64_t tsc) {
+	while (rdtsc() < tsc && !stop_button) {
 #ifdef SHENANGO
-void
-#else 
-void* 
-#endif
-prepare_workload(void* arg) {
-	int i;
-	unsigned long ret;
-	thread_args_t* targs = (thread_args_t*)arg;
-	ZIPFIAN z = create_zipfian(zparams, targs->nkeys, time(NULL)^targs->tid);
-
-	/* generated requests for my section */
-	ASSERT(targs->start + targs->len <= targs->nreqs);
-	for (i = 0; i < targs->len; i++)	{
-		ret = zipfian_gen(z);
-		ASSERT(0 <= ret && ret < targs->nkeys);
-		*(zipf_sequence + targs->start + i) = ret;
-#ifdef DEBUG2
-		zipf_counts[ret]++;
+		thread_yield();
+#else
+		cpu_relax();
 #endif
 	}
-
-	pr_info("worker %d generated %d requests", targs->tid, i);
-	destroy_zipfian(z);
-	WAITGROUP_ADD(workers_wg, -1);	/* signal done */
 }
 
 /* the real work for each request */
@@ -214,8 +224,17 @@ static inline void process_request(int keys[], int nkeys, int nblobs,
 	int i, ret, found;
 	int rdahead, prio;
 	size_t ziplen;
-	void *data, *nextin;
+	void *data;
 	unsigned long value;
+#if (defined(ENCRYPT) && !defined(ENCRYPT_CTR)) || defined(COMPRESS)
+	/* only the cbc and compression stages walk the blob iovecs */
+	struct iovec iov[BLOB_PAGES];
+	int niov;
+#endif
+#if (defined(ENCRYPT) && !defined(ENCRYPT_CTR)) || \
+	(defined(COMPRESS) && !defined(SG))
+	void *nextin;
+#endif
     uint8_t key_template[KEY_LEN] = {
 		0x00, 0x00, 0x00, 0x00,
 		0xff, 0xff, 0xff, 0xff,
@@ -223,12 +242,27 @@ static inline void process_request(int keys[], int nkeys, int nblobs,
 	int ncompress = 0;
 
 	/* lookup hash table a number of times */
-	ASSERT(nkeys > 0);
+	ASSERT(nkeys > 0 && nkeys <= KEYS_PER_REQ);
+#ifdef SERIAL_LOOKUPS
 	for (i = 0; i < nkeys; i++) {
 		*(uint32_t*)key_template = keys[i];
 		value = (unsigned long)hopscotch_lookup(ht, key_template, &found);
 		ASSERT(found);
 	}
+#else
+	/* all at once, to overlap the (remote) memory accesses */
+	uint8_t keybuf[KEYS_PER_REQ][KEY_LEN];
+	void *keyptrs[KEYS_PER_REQ], *values[KEYS_PER_REQ];
+	int founds[KEYS_PER_REQ];
+	for (i = 0; i < nkeys; i++) {
+		memcpy(keybuf[i], key_template, KEY_LEN);
+		*(uint32_t*)keybuf[i] = keys[i];
+		keyptrs[i] = keybuf[i];
+	}
+	found = hopscotch_lookup_batch(ht, keyptrs, nkeys, values, founds);
+	ASSERT(found == nkeys);
+	value = (unsigned long) values[nkeys - 1];
+#endif
 
 	/* use the retrieved value to get the blob; this ensures that array blob
 	 * access distribution is the same as hash table access */
@@ -241,7 +275,9 @@ static inline void process_request(int keys[], int nkeys, int nblobs,
 
 	ASSERT(0 <= value && value < nblobs);
 	BUILD_ASSERT(BLOB_SIZE % PAGE_SIZE == 0);
-	nextin = blobdata + value * BLOB_SIZE;
+#if (defined(ENCRYPT) && !defined(ENCRYPT_CTR)) || defined(COMPRESS)
+	niov = blob_iov(value, nblobs, iov);
+#endif
 
 	/* eden hints for two pages */
 	rdahead = prio = 0;
@@ -252,26 +288,86 @@ static inline void process_request(int keys[], int nkeys, int nblobs,
 	prio = 1;	/* lower prio for polluting array data */
 #endif
 
-	/* set rdahead on the first page, prio on both */
-	HINT_READ_FAULT_ALL(nextin, rdahead, prio);
-	HINT_READ_FAULT_ALL(nextin + PAGE_SIZE, 0, prio);
+	/* set rdahead on the first page, prio on all */
+	for (i = 0; i < BLOB_PAGES; i++)
+		HINT_READ_FAULT_ALL(blob_page(value, nblobs, i), 
+			i == 0 ? rdahead : 0, prio);
 
 #ifdef ENCRYPT
 	/* encrypt data (emits same length as input) */
-	ret = aes_encrypt_cbc(nextin, BLOB_SIZE, encbuffer, aes_ksched, AES_KEY_SIZE, aes_iv);
-	ASSERT(ret);
+#ifdef ENCRYPT_CTR
+	/* in ctr mode, with each page as its own stream (and nonce) so 
+	 * that their blocks can be interleaved in the aes pipeline */
+	const BYTE *pagein[BLOB_PAGES], *pageiv[BLOB_PAGES];
+	BYTE *pageout[BLOB_PAGES], ivs[BLOB_PAGES][AES_BLOCK_SIZE];
+	size_t pagelen[BLOB_PAGES];
+	uint64_t nonce;
+	BUILD_ASSERT(BLOB_PAGES <= AES_CTR_MAX_BUFFERS);
+	for (i = 0; i < BLOB_PAGES; i++) {
+		nonce = value * BLOB_PAGES + i;
+		memcpy(ivs[i], aes_iv, AES_BLOCK_SIZE);
+		memcpy(ivs[i], &nonce, sizeof(nonce));
+		pagein[i] = blob_page(value, nblobs, i);
+		pageout[i] = (BYTE*) encbuffer + i * PAGE_SIZE;
+		pagelen[i] = PAGE_SIZE;
+		pageiv[i] = ivs[i];
+	}
+	aes_encrypt_ctr_multi(pagein, pagelen, pageout, BLOB_PAGES, 
+		aes_ksched, AES_KEY_SIZE, pageiv);
+#else
+	/* one chain across the blob; each run picks up the iv from the 
+	 * last ciphertext block of the one before */
+	const BYTE *iv = aes_iv;
 	nextin = encbuffer;
+	for (i = 0; i < niov; i++) {
+		ret = aes_encrypt_cbc(iov[i].iov_base, iov[i].iov_len, nextin, 
+			aes_ksched, AES_KEY_SIZE, iv);
+		ASSERT(ret);
+		nextin += iov[i].iov_len;
+		iv = nextin - AES_BLOCK_SIZE;
+	}
+#endif
+#ifdef COMPRESS
+	/* the ciphertext is contiguous */
+	iov[0].iov_base = encbuffer;
+	iov[0].iov_len = BLOB_SIZE;
+	niov = 1;
+#endif
 #endif
 
 #ifdef COMPRESS 
 	/* compress the array data */
 	ncompress = COMPRESS;
+#ifdef SG
+	/* straight from the blob pages, scattered or not; the env has no 
+	 * gather buffer so each entry is compressed in place */
+	struct iovec zipiov;
+	int nzipiov;
+	for (i = 0; i < ncompress; i++) {
+		zipiov.iov_base = zipbuffer;
+		zipiov.iov_len = BLOB_PAGES * snappy_max_compressed_length(PAGE_SIZE);
+		nzipiov = 1;
+		ret = snappy_compress_iov(env, iov, niov, BLOB_SIZE, 
+			&zipiov, &nzipiov, &ziplen);
+		ASSERTZ(ret);
+	}
+#else
+	if (niov > 1) {
+		/* no sg support in the library: stage scattered pages */
+		nextin = encbuffer;
+		for (i = 0; i < niov; i++) {
+			memcpy(nextin, iov[i].iov_base, iov[i].iov_len);
+			nextin += iov[i].iov_len;
+		}
+		iov[0].iov_base = encbuffer;
+	}
 	for (i = 0; i < ncompress; i++) {
-		ret = snappy_compress(env, nextin, BLOB_SIZE, zipbuffer, &ziplen);
+		ret = snappy_compress(env, iov[0].iov_base, BLOB_SIZE, 
+			zipbuffer, &ziplen);
 		ASSERTZ(ret);
 	}
+#endif
 	pr_debug("snappy compression done. inlen: %ld outlen: %lu", BLOB_SIZE, ziplen);
-	nextin = zipbuffer;
 #endif
 }
 
@@ -283,10 +379,11 @@ void*
 #endif
 run(void* arg)
 {
-	int ret, i, j, nkeys;
+	int ret, j, nkeys;
 	int keys[KEYS_PER_REQ];
 	void *data, *nextin;
 	unsigned long ystate = 0;
+	uint64_t arrival_tsc;
 	thread_args_t* targs = (thread_args_t*)arg;
     uint8_t key_template[KEY_LEN] = {
 		0x00, 0x00, 0x00, 0x00,
@@ -302,17 +399,15 @@ run(void* arg)
 	/* snappy init */
 	struct snappy_env env;
 	ASSERTZ(snappy_init_env(&env));
-	size_t ziplen = snappy_max_compressed_length(BLOB_SIZE);
+	/* room for sg compression, which may cut fragments at each page */
+	size_t ziplen = BLOB_PAGES * snappy_max_compressed_length(PAGE_SIZE);
 	char* zipbuffer = malloc(ziplen);
 	ASSERT(zipbuffer);
 	FILE* fp;
 	char fname[50];
 
 	/* wait for all threads to be ready */
-	ASSERT(targs->start + targs->len <= targs->nreqs);
-	pr_info("worker %d starting at request %lu len %lu", 
-		targs->tid, targs->start, targs->len);
-
+	pr_info("worker %d ready", targs->tid);
 	BARRIER_WAIT(&ready);
 
 #ifdef WARMUP
@@ -332,13 +427,37 @@ run(void* arg)
 
 	/* actual run */
 	BARRIER_WAIT(&start);
-	for (i = 0; i < targs->len && !stop_button; i += KEYS_PER_REQ) {
+	arrival_tsc = rdtsc();
+	while (!stop_button) {
+		if (worker_rate > 0) {
+			/* open loop: requests arrive at poisson intervals whether 
+			 * or not earlier ones are done, so latency also includes 
+			 * time spent waiting behind them */
+			arrival_tsc += poisson_event(worker_rate, syn_rand_next(&rand)) 
+				* CYCLES_PER_US;
+			wait_until(arrival_tsc);
+			if (stop_button)
+				break;
+		} else {
+			/* closed loop: next request when the last one is done */
+			arrival_tsc = rdtsc();
+		}
+
 		/* pick a set of zipf-distributed keys */
 		BUILD_ASSERT(KEYS_PER_REQ > 0);
-		for (j = 0; j < KEYS_PER_REQ && (i + j) < targs->len; j++)
-			keys[j] = zipf_sequence[targs->start + i + j];
+		for (j = 0; j < KEYS_PER_REQ; j++) {
+#ifdef ZIPF_TABLE
+			keys[j] = zipfian_gen(zipf_table, &rand);
+#else
+			keys[j] = zipf_sampler_next(&zipf, &rand);
+#endif
+#ifdef DEBUG2
+			zipf_counts[keys[j]]++;
+#endif
+		}
 		process_request(keys, KEYS_PER_REQ, targs->nblobs, &env,
 			encbuffer, zipbuffer, syn_rand_next(&rand));
+		lat_hist_add(targs->lat, rdtscp(NULL) - arrival_tsc);
 		targs->xput++;
 		thread_yield_after(1000 /* µs */, &ystate);
 	}
@@ -364,7 +483,6 @@ void main_thread(void* arg) {
 	int i, j, ret, found;
 	struct main_args* margs = (struct main_args*) arg;
 	unsigned long nkeys = margs->nkeys;
-	unsigned long nreqs = margs->nreqs;
 	unsigned long nblobs = margs->nblobs;
 	int nworkers = margs->nworkers;
 	unsigned long timeout_us;
@@ -376,6 +494,7 @@ void main_thread(void* arg) {
 		0xff, 0xff, 0xff, 0xff };
 	uint64_t start_tsc, duration_tsc, now_tsc, xput = 0;
 	double duration_secs;
+	struct lat_hist* lat;
 	THREAD_T* workers;
 	THREAD_T timer1, timer2;
 
@@ -385,9 +504,19 @@ void main_thread(void* arg) {
 	fwrite_number("main_pid", getpid());
     sleep(1);
 
+#ifdef ZTIER
+	/* compressed in-memory tier; budget from ZTIER_LOCAL_MEM */
+	ASSERTZ(ztier_init());
+#endif
+
 	/* core data stuctures: these go in remote memory */
-    ht = hopscotch_init(NULL, next_power_of_two(nkeys) + 1);
+    /* no need to oversize, the table grows online */
+    ht = hopscotch_init(NULL, next_power_of_two(nkeys));
     ASSERT(ht);
+#ifdef DEBUG
+	ASSERTZ(hopscotch_hash_test(next_power_of_two(nkeys)));
+	ASSERTZ(hopscotch_stress_test(nworkers, 1 << 18));
+#endif
 	blobdata = RMALLOC(nblobs*BLOB_SIZE);
     pr_info("memory for blob array: %lu MB", nblobs*BLOB_SIZE / (1<<20));
     pr_info("blob array start: %p, end: 0x%lx", 
@@ -410,6 +539,7 @@ void main_thread(void* arg) {
 		ASSERTZ(ret);
 	}
 	WAITGROUP_WAIT(workers_wg);
+	hopscotch_reclaim(ht);	/* free tables left behind by resizes */
 	pr_info("hash table setup done");
 
 	/* setup blob array */
@@ -442,41 +572,18 @@ void main_thread(void* arg) {
 
 	/* aes init */
 	aes_key_setup(aes_key, aes_ksched, AES_KEY_SIZE);
+#ifdef DEBUG
+	ASSERT(aes_cbc_test() && aes_ctr_test());
+#endif
 
-	/* prepare zipf request sequence  */	
-	zparams = margs->zparams;
-	zipf_sequence = (uint64_t*) malloc (nreqs * sizeof(uint64_t));
-	ASSERT(zipf_sequence);
-
-	/* for fastswap, we don't have control over what goes in remote memory.
-	 * so we pin this request data and count this out of local memory  */
-	LOCK_MEMORY(zipf_sequence, nreqs * sizeof(uint64_t));
-    pr_info("memory for req data: %lu MB", nreqs * sizeof(uint64_t) / (1<<20));
-
-#ifdef DEBUG2
-	zipf_counts = (uint32_t*)calloc(nkeys, sizeof(uint32_t));
+	/* zipf key distribution; keys are drawn on the fly by workers */
+	zipf_sampler_init(&zipf, margs->zparams, nkeys);
+#ifdef ZIPF_TABLE
+	/* or the table-based generator, built once for all workers */
+	zipf_table = create_zipfian(margs->zparams, nkeys);
 #endif
-	WAITGROUP_INIT(workers_wg);
-	shard_sz = ceil(nreqs * 1.0 / nworkers);
-	for (j = 0; j < nworkers; j++) {
-		targs[j].tid = j;
-		targs[j].nkeys = nkeys;
-		targs[j].nreqs = nreqs;
-		targs[j].nblobs = nblobs;
-		targs[j].start = MIN(j * shard_sz, nreqs);
-		targs[j].len = MIN(shard_sz, nreqs - targs[j].start);
-		WAITGROUP_ADD(workers_wg, 1);
-		ret = THREAD_CREATE(&workers[j], prepare_workload, &targs[j]);
-		ASSERTZ(ret);
-	}
-	WAITGROUP_WAIT(workers_wg);
-	pr_info("generated zipf sequence of length: %lu", nreqs);
 #ifdef DEBUG2
-	// printf("zipf seq: ");
-	// for (j = 0; j < nreqs; j++)	printf("%lu ", zipf_sequence[j]);
-	printf("\ncounts: ");
-	for (j = 0; j < nkeys; j++)	printf("%u ", zipf_counts[j]);
-	printf("\n");
+	zipf_counts = (uint32_t*)calloc(nkeys, sizeof(uint32_t));
 #endif
 
 	/* run requests */
@@ -485,15 +592,15 @@ void main_thread(void* arg) {
 	BARRIER_INIT(&warmup, nworkers+1);
 	BARRIER_INIT(&warmedup, nworkers+1);
 	BARRIER_INIT(&start, nworkers+1);
-	shard_sz = ceil(nreqs * 1.0 / nworkers);
+	worker_rate = margs->load / nworkers / MILLION;
 	for (j = 0; j < nworkers; j++) {
 		targs[j].tid = j;
 		targs[j].nkeys = nkeys;
-		targs[j].nreqs = nreqs;
 		targs[j].nblobs = nblobs;
-		targs[j].start = MIN(j * shard_sz, nreqs);
-		targs[j].len = MIN(shard_sz, nreqs - targs[j].start);
 		targs[j].xput = 0;
+		targs[j].lat = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct lat_hist));
+		ASSERT(targs[j].lat);
+		lat_hist_init(targs[j].lat);
 		WAITGROUP_ADD(workers_wg, 1);
 		ret = THREAD_CREATE(&workers[j], run, &targs[j]);
 		ASSERTZ(ret);
@@ -517,6 +624,8 @@ void main_thread(void* arg) {
 
 	/* start the run (with timeout) */
 	pr_info("starting the run");
+	if (margs->load > 0)
+		pr_info("with open-loop poisson arrivals at %.0lf ops /sec", margs->load);
 #ifdef USE_READAHEAD
 	pr_info("with readahead hints");
 #endif
@@ -535,6 +644,9 @@ void main_thread(void* arg) {
 	/* print memory used */
 	pr_info("memory used at finish: %lu", atomic64_read(&memory_used));
 #endif
+#ifdef ZTIER
+	ztier_print_stats(CYCLES_PER_US);
+#endif
 
 	/* write result */
 	duration_secs = duration_tsc * 1.0 / (MILLION * CYCLES_PER_US);
@@ -543,11 +655,36 @@ void main_thread(void* arg) {
 		duration_secs, xput/duration_secs);
 	printf("result:%.0lf\n", xput / duration_secs);
 
-	/* we must run for at least a few secs
-	 * adjust MAX_OPS_PER_CORE otherwise */
+	/* latency across workers, in µs */
+	lat = targs[0].lat;
+	for (j = 1; j < nworkers; j++)	lat_hist_merge(lat, targs[j].lat);
+	pr_info("latency in µs: %.1lf (p50), %.1lf (p99), %.1lf (p99.9), %.1lf (max)",
+		lat_hist_percentile(lat, 50) * 1.0 / CYCLES_PER_US,
+		lat_hist_percentile(lat, 99) * 1.0 / CYCLES_PER_US,
+		lat_hist_percentile(lat, 99.9) * 1.0 / CYCLES_PER_US,
+		lat->max * 1.0 / CYCLES_PER_US);
+	if (margs->load > 0) {
+		printf("offered:%.0lf\n", margs->load);
+		if (xput / duration_secs < 0.95 * margs->load)
+			pr_warn("could not keep up with the offered load");
+	}
+	printf("p50:%.1lf\n", lat_hist_percentile(lat, 50) * 1.0 / CYCLES_PER_US);
+	printf("p99:%.1lf\n", lat_hist_percentile(lat, 99) * 1.0 / CYCLES_PER_US);
+	printf("p999:%.1lf\n", lat_hist_percentile(lat, 99.9) * 1.0 / CYCLES_PER_US);
+
+	/* we must run for at least a few secs */
 	ASSERT(duration_secs >= MIN_RUNTIME_SECS);
 
+#ifdef DEBUG2
+	printf("zipf counts: ");
+	for (j = 0; j < nkeys; j++)	printf("%u ", zipf_counts[j]);
+	printf("\n");
+#endif
+
     /* Release */
+#ifdef ZIPF_TABLE
+	destroy_zipfian(zipf_table);
+#endif
     hopscotch_release(ht);
 }
 
@@ -556,7 +693,7 @@ int main(int argc, char *argv[]) {
 
 	if (argc < 4) {
 		pr_err("USAGE: %s <config-file> <ncores> <nworkers> [<nkeys>] "
-			"[<nblobs>] [<zipfparamS>]\n", argv[0]);
+			"[<nblobs>] [<zipfparamS>] [<load ops/sec, 0 for closed loop>]\n", argv[0]);
 		return -EINVAL;
 	}
 	CYCLES_PER_US = time_calibrate_tsc();
@@ -568,7 +705,7 @@ int main(int argc, char *argv[]) {
 	margs.nkeys = (argc > 4) ? atoi(argv[4]) : MILLION;
 	margs.nblobs = (argc > 5) ? atof(argv[5]) : MILLION;
 	margs.zparams = (argc > 6) ? atof(argv[6]) : 0.1;
-	margs.nreqs = (margs.ncores * (unsigned long) MAX_OPS_PER_CORE * MIN_RUNTIME_SECS);
+	margs.load = (argc > 7) ? atof(argv[7]) : 0;
 
 #ifdef SHENANGO
 	/* initialize shenango */
@@ -13,11 +13,14 @@ usage="bash run.sh
 -e, --eden \t run with Eden's remote memory\n
 -h, --hints \t enable Eden's remote memory hints\n
 -fs, --fastswap \t enable remote memory with fastswap\n
+-zt, --ztier \t enable the compressed in-memory tier (userfaultfd + snappy) instead\n
 -t, --threads \t number of shenango worker threads (defaults to --cores)\n
 -c, --cores \t number of CPU cores (defaults to 1)\n
 -zs, --zipfs \t S param of zipf workload\n
 -nk, --nkeys \t number of keys in the hash table\n
 -nb, --nblobs \t number of items in the blob array\n
+-ld, --load \t offered load (ops/sec) for an open-loop run with poisson arrivals (defaults to closed-loop)\n
+-cb, --compactbuckets \t use compact (cache-line packed) hash table buckets\n
 -lm, --localmem \t local memory (in bytes)\n
 -lmp, --lmemper \t local memory percentage compared to max rss (only for logging)\n
 -w, --warmup \t run warmup for a few seconds before taking measurement\n
@@ -83,6 +86,7 @@ NCORES=1
 ZIPFS="0.1"
 NKEYS=1000
 NBLOBS=1000
+LOAD=0
 LMEM=1000000000    # 1GB
 
 # save settings
@@ -141,6 +145,10 @@ case $i in
     #SHENANGO=1
     ;;
 
+    -zt|--ztier)
+    ZTIER=1
+    ;;
+
     -be=*|--batchevict=*)
     EVICT_BATCH_SIZE="${i#*=}"
     SHEN_CFLAGS="$SHEN_CFLAGS -DVECTORED_MADVISE -DVECTORED_MPROTECT"
@@ -200,11 +208,19 @@ case $i in
     NBLOBS=${i#*=}
     ;;
 
+    -ld=*|--load=*)
+    LOAD=${i#*=}
+    ;;
+
     -kpr=*|--keyspreq=*)
     KEYS_PER_REQ=${i#*=}
     CFLAGS="$CFLAGS -DKEYS_PER_REQ=$KEYS_PER_REQ"
     ;;
 
+    -cb|--compactbuckets)
+    CFLAGS="$CFLAGS -DCOMPACT_BUCKETS"
+    ;;
+
     -lm=*|--localmem=*)
     LMEM=${i#*=}
     ;;
@@ -412,6 +428,17 @@ if [[ $FASTSWAP ]]; then
     popd
 fi
 
+# Compressed in-memory tier
+if [[ $ZTIER ]]; then
+    RMEM="ztier"
+    CFLAGS="$CFLAGS -DZTIER"
+
+    if [[ $EDEN ]] || [[ $FASTSWAP ]] || [[ $SHENANGO ]]; then
+        echo "ERROR! ztier can't be enabled with eden, fastswap or shenango"
+        exit 1
+    fi
+fi
+
 # rebuild shenango
 if [[ $FORCE ]] && [[ $SHENANGO ]]; then
     pushd ${SHENANGO_DIR}
@@ -449,7 +476,11 @@ LIBS="${LIBS} ${SNAPPY_DIR}/libsnappyc.so"
 
 # compile
 LIBS="${LIBS} -lpthread -lm"
-gcc -O0 -g -ggdb main.c utils.c hopscotch.c zipf.c aes.c -D_GNU_SOURCE \
+# hw crc32c for hash table keys where the host has it, wyhash otherwise
+if grep -qw sse4_2 /proc/cpuinfo; then
+    CFLAGS="${CFLAGS} -msse4.2"
+fi
+gcc -O0 -g -ggdb main.c utils.c hopscotch.c zipf.c aes.c ztier.c -D_GNU_SOURCE \
     ${INC} ${LIBS} ${CFLAGS} ${LDFLAGS} -o ${BINFILE}
 
 if [[ $BUILD_ONLY ]]; then 
@@ -467,6 +498,7 @@ save_cfg "threads"      $NTHREADS
 save_cfg "keys"         $NKEYS
 save_cfg "blobs"        $NBLOBS
 save_cfg "zipfs"        $ZIPFS
+save_cfg "load"         $LOAD
 save_cfg "warmup"       $WARMUP
 save_cfg "scheduler"    $SCHEDULER
 save_cfg "rmem"         $RMEM
@@ -555,6 +587,9 @@ for retry in 1; do
         env="$env RDMA_RACK_CNTRL_PORT=$RCNTRL_PORT"
         wrapper="$wrapper $env"
     fi
+    if [[ $ZTIER ]]; then
+        wrapper="$wrapper ZTIER_LOCAL_MEM=${LMEM}"
+    fi
 
     if [[ $SHENANGO ]]; then 
         # shenango takes care of scheduling but we still want 
@@ -590,7 +625,7 @@ for retry in 1; do
     fi
 
     # run
-    args="${CFGFILE} ${NCORES} ${NTHREADS} ${NKEYS} ${NBLOBS} ${ZIPFS}"
+    args="${CFGFILE} ${NCORES} ${NTHREADS} ${NKEYS} ${NBLOBS} ${ZIPFS} ${LOAD}"
     echo sudo ${wrapper} ${BINFILE} ${args} 
     nohup sudo ${wrapper} ${BINFILE} ${args} 2>&1 | tee app.out &
 
@@ -157,6 +157,7 @@ for exp in $LS_CMD; do
     nkeys=$(cat $exp/settings | grep "keys:" | awk -F: '{ print $2 }')
     nblobs=$(cat $exp/settings | grep "blobs:" | awk -F: '{ print $2 }')
     zipfs=$(cat $exp/settings | grep "zipfs:" | awk -F: '{ print $2 }')
+    load=$(cat $exp/settings | grep "load:" | awk -F: '{ print $2 }')
     rdahead=$(cat $exp/settings | grep "rdahead:" | awk -F: '{ print $2 }')
     evictbs=$(cat $exp/settings | grep "evictbatch:" | awk -F: '{ print $2 }')
     evictpol=$(cat $exp/settings | grep "evictpolicy:" | awk -F: '{ print $2 }')
@@ -194,6 +195,9 @@ for exp in $LS_CMD; do
         rend=$(cat $exp/run_end 2>/dev/null)
         rtime=$((rend-rstart))
         xput=$(grep "result:" $exp/app.out | sed -n "s/^.*result://p")
+        p50=$(grep "p50:" $exp/app.out | sed -n "s/^.*p50://p")
+        p99=$(grep "p99:" $exp/app.out | sed -n "s/^.*p99://p")
+        p999=$(grep "p999:" $exp/app.out | sed -n "s/^.*p999://p")
         xputpercore=
         if [[ $xput ]]; then xputpercore=$((xput/cores));   fi
 
@@ -321,7 +325,11 @@ for exp in $LS_CMD; do
     if [ -z "$BASIC" ]; then
         # HEADER="$HEADER,PreloadTime";   LINE="$LINE,${ptime}";
         # HEADER="$HEADER,Runtime";       LINE="$LINE,${rtime}";
+        HEADER="$HEADER,Load";          LINE="$LINE,${load:-0}";
         HEADER="$HEADER,Xput";          LINE="$LINE,${xput:-}";
+        HEADER="$HEADER,P50";           LINE="$LINE,${p50:-}";
+        HEADER="$HEADER,P99";           LINE="$LINE,${p99:-}";
+        HEADER="$HEADER,P999";          LINE="$LINE,${p999:-}";
         # HEADER="$HEADER,XputPerCore";   LINE="$LINE,${xputpercore}";
         HEADER="$HEADER,Faults";        LINE="$LINE,${faults}";
         HEADER="$HEADER,FaultsR";       LINE="$LINE,${faultsr}";
@@ -4,8 +4,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include "map.h"
 #include "snappy.h"
+#include "snappy-framed.h"
 #include "util.h"
 #include "compat.h"
 
@@ -58,14 +60,81 @@ typedef unsigned long long counter_t;
 
 #include "glue.c"
 
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* framed stream throughput for 1, 2, 4, ... max_threads threads */
+void test_framed(char *map, size_t size, char *fn, int max_threads)
+{
+	size_t outlen = snappy_framed_max_compressed_length(size);
+	char *out = xmalloc(outlen);
+	char *buf2 = xmalloc(size);
+	int i, err, threads;
+
+	for (threads = 1; ; threads *= 2) {
+		if (threads > max_threads)
+			threads = max_threads;
+
+		struct snappy_framed *f = snappy_framed_new(threads);
+		double a, total_comp = 0, total_uncomp = 0;
+		size_t clen = 0, ulen, consumed;
+
+		if (!f)
+			err("snappy_framed_new");
+		for (i = 0; i < N + 1; i++) {
+			snappy_framed_reset(f);
+			a = now();
+			err = snappy_framed_compress(f, map, size, out, &clen);
+			if (i > 0)
+				total_comp += now() - a;
+			if (err)
+				printf("framed: compression of %s failed: %d\n", fn, err);
+
+			ulen = size;
+			a = now();
+			err = snappy_framed_uncompress(f, out, clen, &consumed,
+						       buf2, &ulen);
+			if (i > 0)
+				total_uncomp += now() - a;
+			if (err || consumed != clen || ulen != size)
+				printf("framed: uncompression of %s failed: %d\n", fn, err);
+			int o = compare(buf2, map, size);
+			if (o >= 0)
+				printf("framed: final comparision failed at %d of %lu\n", o, (unsigned long)size);
+		}
+		printf("%-6s: %s: %lu b: threads %2d: ratio %.02f: comp %6.0f uncomp %6.0f MB/s\n",
+		       "framed", basen(fn), (unsigned long)size, threads,
+		       (double)clen / size,
+		       size * N / total_comp / 1e6,
+		       size * N / total_uncomp / 1e6);
+		snappy_framed_free(f);
+		if (threads == max_threads)
+			break;
+	}
+
+	free(out);
+	free(buf2);
+}
+
 int main(int ac, char **av)
 {
 	int snappy_only = 0;
+	int max_threads = 0;
 
 	if (av[1] && !strcmp(av[1], "-s")) {
 		snappy_only = 1;
 		av++;
 	}
+	/* -t N: framed throughput vs. threads instead of the codec table */
+	if (av[1] && !strcmp(av[1], "-t") && av[2]) {
+		max_threads = atoi(av[2]);
+		av += 2;
+	}
 
 #ifdef SIMPLE_PMU
 	pin_cpu(NULL);
@@ -86,6 +155,11 @@ int main(int ac, char **av)
 			v = ((volatile char *)map)[i];
 		memeat(v);
 
+		if (max_threads > 0) {
+			test_framed(map, size, *av, max_threads);
+			goto unmap;
+		}
+
 #ifdef COMP
 		test_lz4(map, size, *av);
 #endif
@@ -0,0 +1,33 @@
+#ifndef _SNAPPY_FRAMED_H
+#define _SNAPPY_FRAMED_H 1
+
+#include <stddef.h>
+
+/*
+ * Snappy framing format (framing_format.txt in the upstream snappy tree):
+ * a stream identifier followed by chunks of at most 64KB of input, each
+ * carrying a masked CRC32C of its uncompressed data. Chunks are
+ * independent, so both directions run on a pool of worker threads.
+ */
+#define SNAPPY_FRAME_CHUNK	65536
+
+struct snappy_framed;
+
+struct snappy_framed *snappy_framed_new(int nthreads);
+void snappy_framed_free(struct snappy_framed *f);
+void snappy_framed_reset(struct snappy_framed *f);
+size_t snappy_framed_max_compressed_length(size_t source_len);
+int snappy_framed_compress(struct snappy_framed *f,
+			   const char *input,
+			   size_t input_length,
+			   char *compressed,
+			   size_t *compressed_length);
+int snappy_framed_uncompress(struct snappy_framed *f,
+			     const char *compressed,
+			     size_t n,
+			     size_t *consumed,
+			     char *uncompressed,
+			     size_t *uncompressed_length);
+unsigned snappy_crc32c(unsigned crc, const void *buf, size_t len);
+
+#endif
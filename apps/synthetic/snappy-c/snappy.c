@@ -51,6 +51,10 @@
 #include <stdio.h>
 #include "snappy.h"
 #include "compat.h"
+#if defined(__x86_64__) && !defined(SNAPPY_NO_AVX2)
+#include <immintrin.h>
+#define SNAPPY_AVX2 1
+#endif
 #endif
 
 #define CRASH_UNLESS(x) BUG_ON(!(x))
@@ -788,6 +792,33 @@ static inline int find_match_length(const char *s1,
 }
 #endif
 
+#ifdef SNAPPY_AVX2
+#define SNAPPY_AVX2_TARGET __attribute__((target("avx2")))
+
+/*
+ * find_match_length() 32 bytes at a time. Same result and the same limits
+ * on what it reads.
+ */
+static inline SNAPPY_AVX2_TARGET
+int find_match_length_avx2(const char *s1, const char *s2, const char *s2_limit)
+{
+	int matched = 0;
+	u32 diff;
+
+	DCHECK_GE(s2_limit, s2);
+	while (likely(s2 <= s2_limit - 32)) {
+		diff = ~(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)s2),
+			_mm256_loadu_si256((const __m256i *)(s1 + matched))));
+		if (diff)
+			return matched + find_lsb_set_non_zero(diff);
+		s2 += 32;
+		matched += 32;
+	}
+	return matched + find_match_length(s1 + matched, s2, s2_limit);
+}
+#endif
+
 /*
  * For 0 <= offset <= 4, GetU32AtOffset(GetEightBytesAt(p), offset) will
  *  equal UNALIGNED_LOAD32(p + offset).  Motivation: On x86-64 hardware we have
@@ -850,9 +881,12 @@ static inline u32 get_u32_at_offset(const char *v, int offset)
  * "end - op" is the compressed size of "input".
  */
 
-static char *compress_fragment(const char *const input,
-			       const size_t input_size,
-			       char *op, u16 * table, const unsigned table_size)
+static inline __attribute__((always_inline))
+char *compress_fragment_tmpl(const char *const input,
+			     const size_t input_size,
+			     char *op, u16 * table, const unsigned table_size,
+			     int (*match_length)(const char *, const char *,
+						 const char *))
 {
 	/* "ip" is the input pointer, and "op" is the output pointer. */
 	const char *ip = input;
@@ -954,8 +988,7 @@ static char *compress_fragment(const char *const input,
  */
 				const char *base = ip;
 				int matched = 4 +
-				    find_match_length(candidate + 4, ip + 4,
-						      ip_end);
+				    match_length(candidate + 4, ip + 4, ip_end);
 				ip += matched;
 				int offset = base - candidate;
 				DCHECK_EQ(0, memcmp(base, candidate, matched));
@@ -998,6 +1031,48 @@ emit_remainder:
 	return op;
 }
 
+static char *compress_fragment_scalar(const char *const input,
+				      const size_t input_size, char *op,
+				      u16 * table, const unsigned table_size)
+{
+	return compress_fragment_tmpl(input, input_size, op, table, table_size,
+				      find_match_length);
+}
+
+#ifdef SNAPPY_AVX2
+static SNAPPY_AVX2_TARGET
+char *compress_fragment_avx2(const char *const input,
+			     const size_t input_size, char *op,
+			     u16 * table, const unsigned table_size)
+{
+	return compress_fragment_tmpl(input, input_size, op, table, table_size,
+				      find_match_length_avx2);
+}
+#endif
+
+/*
+ * Picks the AVX2 compressor when the CPU has it. Either one emits exactly
+ * the same bytes.
+ */
+static char *compress_fragment(const char *const input,
+			       const size_t input_size,
+			       char *op, u16 * table, const unsigned table_size)
+{
+#ifdef SNAPPY_AVX2
+	static int use_avx2 = -1;
+
+	if (unlikely(use_avx2 < 0)) {
+		__builtin_cpu_init();
+		use_avx2 = __builtin_cpu_supports("avx2");
+	}
+	if (use_avx2)
+		return compress_fragment_avx2(input, input_size, op, table,
+					      table_size);
+#endif
+	return compress_fragment_scalar(input, input_size, op, table,
+					table_size);
+}
+
 /*
  * -----------------------------------------------------------------------
  *  Lookup table for decompression code.  Generated by ComputeTable() below.
@@ -1321,7 +1396,7 @@ static inline int compress(struct snappy_env *env, struct source *reader,
 			err = -EIO;
 			goto out;
 		}
-		const unsigned num_to_read = min_t(int, N, kblock_size);
+		unsigned num_to_read = min_t(int, N, kblock_size);
 		size_t bytes_read = fragment_size;
 
 		int pending_advance = 0;
@@ -1330,6 +1405,16 @@ static inline int compress(struct snappy_env *env, struct source *reader,
 			pending_advance = num_to_read;
 			fragment_size = num_to_read;
 		}
+		else if (!env->scratch) {
+			/*
+			 * No gather buffer: compress the contiguous piece
+			 * in place as a fragment of its own. Fragments never
+			 * reference each other, so the stream stays valid;
+			 * matches across the boundary are lost.
+			 */
+			num_to_read = bytes_read;
+			pending_advance = num_to_read;
+		}
 		else {
 			memcpy(env->scratch, fragment, bytes_read);
 			skip(reader, bytes_read);
@@ -1364,6 +1449,10 @@ static inline int compress(struct snappy_env *env, struct source *reader,
 			 * in one piece.
 			 */
 			dest = env->scratch_output;
+			if (!dest) {
+				err = -ENOSPC;
+				goto out;
+			}
 		}
 		char *end = compress_fragment(fragment, fragment_size,
 					      dest, table, table_size);
@@ -1557,8 +1646,11 @@ static inline void clear_env(struct snappy_env *env)
  * @env: Environment to preallocate
  * @sg: Input environment ever does scather gather
  *
- * If false is passed to sg then multiple entries in an iovec
- * are not legal.
+ * If false is passed to sg then no gather buffers are allocated:
+ * each input iovec entry shorter than a block is compressed in place
+ * as its own fragment, without copying, at some cost in ratio. The
+ * output must then be a single entry of at least the sum of
+ * snappy_max_compressed_length() over the input entries.
  * Returns 0 on success, otherwise negative errno.
  * Must run in process context.
  */
@@ -1588,8 +1680,8 @@ EXPORT_SYMBOL(snappy_init_env_sg);
  * snappy_init_env - Allocate snappy compression environment
  * @env: Environment to preallocate
  *
- * Passing multiple entries in an iovec is not allowed
- * on the environment allocated here.
+ * Multiple entries in an iovec are compressed piecewise, without
+ * copying, on the environment allocated here (see snappy_init_env_sg).
  * Returns 0 on success, otherwise negative errno.
  * Must run in process context.
  */
@@ -167,7 +167,7 @@ LIBS="${LIBS} ${SNAPPY_DIR}/libsnappyc.so"
 CFLAGS="$CFLAGS -DKEYS_PER_REQ=16"
 CFLAGS="$CFLAGS -DCOMPRESS=5"
 LIBS="${LIBS} -lpthread -lm"
-gcc -O0 -g -ggdb main.c utils.c hopscotch.c zipf.c aes.c -D_GNU_SOURCE \
+gcc -O0 -g -ggdb main.c utils.c hopscotch.c zipf.c aes.c ztier.c -D_GNU_SOURCE \
     ${INC} ${LIBS} ${CFLAGS} ${LDFLAGS} -o ${BINFILE}
 
 # initialize run
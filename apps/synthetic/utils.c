@@ -107,4 +107,44 @@ uint64_t syn_rand_next(struct syn_rand_state* state) {
 
 	s[3] = rotl(s[3], 45);
 	return result;
-}
\ No newline at end of file
+}
+void lat_hist_init(struct lat_hist* hist) {
+	memset(hist, 0, sizeof(struct lat_hist));
+}
+
+void lat_hist_merge(struct lat_hist* dst, const struct lat_hist* src) {
+	int i;
+	for (i = 0; i < LAT_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* highest value in the bucket of the given index */
+static uint64_t lat_hist_value(unsigned int idx) {
+	unsigned int shift;
+	if (idx < LAT_HIST_SUB)
+		return idx;
+	shift = (idx >> LAT_HIST_SUB_BITS) - 1;
+	return (((uint64_t)(idx & (LAT_HIST_SUB - 1)) + LAT_HIST_SUB + 1) << shift) - 1;
+}
+
+/* value at the given percentile (0-100), to within a bucket */
+uint64_t lat_hist_percentile(const struct lat_hist* hist, double pct) {
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+	rank = (uint64_t) ceil(pct / 100.0 * hist->count);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return (lat_hist_value(i) < hist->max) ? 
+				lat_hist_value(i) : hist->max;
+	}
+	return hist->max;
+}
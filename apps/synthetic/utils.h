@@ -96,4 +96,37 @@ struct syn_rand_state {
 int syn_rand_seed(struct syn_rand_state* result, uint64_t seed);
 uint64_t syn_rand_next(struct syn_rand_state* state);
 
+/* log-linear latency histogram: each power of two range is split into 
+ * 2^LAT_HIST_SUB_BITS linear buckets, so values are kept to within 
+ * ~3% in constant space. histograms of the same kind can be merged */
+#define LAT_HIST_SUB_BITS 5
+#define LAT_HIST_SUB      (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_BUCKETS  ((65 - LAT_HIST_SUB_BITS) * LAT_HIST_SUB)
+
+struct lat_hist {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[LAT_HIST_BUCKETS];
+};
+
+static inline unsigned int lat_hist_index(uint64_t val) {
+  unsigned int msb;
+  if (val < LAT_HIST_SUB)
+    return val;
+  msb = 63 - __builtin_clzll(val);
+  return ((msb - LAT_HIST_SUB_BITS + 1) << LAT_HIST_SUB_BITS) + 
+    (val >> (msb - LAT_HIST_SUB_BITS)) - LAT_HIST_SUB;
+}
+
+static inline void lat_hist_add(struct lat_hist* hist, uint64_t val) {
+  hist->buckets[lat_hist_index(val)]++;
+  hist->count++;
+  if (val > hist->max)
+    hist->max = val;
+}
+
+void lat_hist_init(struct lat_hist* hist);
+void lat_hist_merge(struct lat_hist* dst, const struct lat_hist* src);
+uint64_t lat_hist_percentile(const struct lat_hist* hist, double pct);
+
 #endif  // __UTILS_H__
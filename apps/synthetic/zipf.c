@@ -9,143 +9,210 @@
 #include <stdio.h>
 #include <time.h>
 
-#define USE_MYRANDOM	/* custom rng */
-#ifdef USE_MYRANDOM
 #include "utils.h"
-#endif
 
-struct zpair {                   // For the ith element of the array:
-    long num;                    //   How many elements are represented by this bucket
+struct zbucket {                 // For the ith bucket in the table:
     long low;                    //   How many elements are represented by all the previous buckets.
-    double cumulative;           //   The sum of the all the probabilities of all the elements represented by previous buckets.
+    long num;                    //   How many elements are represented by this bucket
 };
 
-enum { NPAIRS = 1000000 };
+enum { NPAIRS = 1000000 };       // Buckets; the first NPAIRS/2 hold one element each.
 
 struct zipfian {
     double s;                    // s, the characteristic exponent.
     long N;                      // N, the size of the universe.
     double H_Ns;                 // H_{N,s}.
-    long int (*randomfun)(void);
-    struct zpair pairs[NPAIRS]; 
-#ifdef USE_MYRANDOM
-	struct syn_rand_state rs;
-#endif
+    long npairs;                 // Number of buckets, min(N, NPAIRS).
+    // Buckets are stored in Eytzinger (BFS) order, 1-indexed, with the 
+    // cumulative probabilities in their own array so that the top levels 
+    // of the search tree share a few cache lines.
+    double *cumulative;          // Sum of the probabilities of all the previous buckets.
+    struct zbucket *buckets;
 };
 
-#ifdef USE_MYRANDOM
-static inline void random_seed(struct zipfian* z, unsigned long seed) {
-	ASSERTZ(syn_rand_seed(&z->rs, seed));
+static void zprint (ZIPFIAN z) {
+    printf("s=%f, N=%ld, H_sN=%f, buckets=%ld\n", z->s, z->N, z->H_Ns, z->npairs);
 }
 
-static inline long random_gen(struct zipfian* z) {
-	return syn_rand_next(&z->rs) % RAND_MAX;
+// Helpers for rejection-inversion. H(x) is an integral of h(x) = x^{-s},
+// written with log1p/expm1 so that it stays accurate (and continuous) at s=1.
+static inline double zr_helper1 (double x) {
+    // log(1+x)/x
+    return (fabs(x) > 1e-8) ? log1p(x) / x : 1 - x * (0.5 - x * (1.0/3 - 0.25 * x));
 }
-#else
-static inline void random_seed(struct zipfian* z, unsigned long seed) {
-	srandom(seed);
+
+static inline double zr_helper2 (double x) {
+    // (exp(x)-1)/x
+    return (fabs(x) > 1e-8) ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0/3) * (1 + 0.25 * x));
 }
 
-static inline long random_gen(struct zipfian* z) {
-	return random();
+static inline double zr_h (double s, double x) {
+    return exp(-s * log(x));
 }
-#endif
 
+static inline double zr_H (double s, double x) {
+    double logx = log(x);
+    return zr_helper2((1 - s) * logx) * logx;
+}
 
-static void zprint (ZIPFIAN z) {
-    int i = 0;
-    printf("s=%f, N=%ld, H_sN=%f\n", z->s, z->N, z->H_Ns);
-    // for (i=0; i<NPAIRS; i++) {
-	// double diff =    ((i+1>=NPAIRS) ? z->H_Ns : z->pairs[i+1].cumulative) - z->pairs[i].cumulative;
-	// printf("%2ld %2ld %f (delta=%f)\n", z->pairs[i].num, z->pairs[i].low, z->pairs[i].cumulative, diff);
-    // }
+static inline double zr_Hinv (double s, double x) {
+    double t = x * (1 - s);
+    if (t < -1) t = -1;          // numerical safety
+    return exp(zr_helper1(t) * x);
 }
 
-ZIPFIAN create_zipfian (double s, long N, unsigned long seed) {
+// Sum of i^{-s} for n < i <= N in closed form (Euler-Maclaurin), for the 
+// tail of large universes. Good to ~s^3 n^{-s-3}, so exact in doubles for 
+// the n >= NPAIRS/2 we use it with.
+static double zr_tail (double s, long n, long N) {
+    double lr = log((double)N / n);
+    double integral = zr_h(s, n) * n * zr_helper2((1 - s) * lr) * lr;
+    return integral + (zr_h(s, N) - zr_h(s, n)) / 2
+        - s * (zr_h(s, N) / N - zr_h(s, n) / n) / 12;
+}
+
+// Smallest n in [lo, hi] whose tail zr_tail(s, n, N) is at most _goal_. 
+// Inverts the midpoint integral in closed form, then fixes up the rounding.
+static long zr_tail_inv (double s, long N, double goal, long lo, long hi) {
+    double a = 1 - s, z, ln;
+    long n;
+    z = goal / (zr_h(s, N + 0.5) * (N + 0.5));
+    ln = (-a * z <= -1) ? 0 : log(N + 0.5) - z * zr_helper1(-a * z);
+    n = (long)(exp(ln) - 0.5);
+    if (n < lo) n = lo;
+    if (n > hi) n = hi;
+    while (n > lo && zr_tail(s, n - 1, N) <= goal) n--;
+    while (n < hi && zr_tail(s, n, N) > goal) n++;
+    return n;
+}
+
+// Lay out a sorted array in Eytzinger order (the in-order walk of the 
+// implicit tree rooted at 1 visits the sorted elements in turn).
+static void eytzinger_fill (const double *cum, const struct zbucket *b, 
+        struct zipfian *z) {
+    long i, k = 1;
+    // iterative in-order walk: the successor of a node is the leftmost 
+    // node of its right subtree or, without one, the parent of the first
+    // ancestor that is a left child
+    while (2 * k <= z->npairs) k = 2 * k;
+    for (i = 0; i < z->npairs; i++) {
+        z->cumulative[k] = cum[i];
+        z->buckets[k] = b[i];
+        if (2 * k + 1 <= z->npairs) {
+            k = 2 * k + 1;
+            while (2 * k <= z->npairs) k = 2 * k;
+        } else {
+            while (k & 1) k >>= 1;
+            k >>= 1;
+        }
+    }
+}
+
+ZIPFIAN create_zipfian (double s, long N) {
     assert(s > 0);
     assert(0 < N);
     struct zipfian *z = (struct zipfian *)malloc(sizeof(*z));
     assert(z);
     z->s = s;
     z->N = N;
-	random_seed(z, seed);
+    z->npairs = (N < NPAIRS) ? N : NPAIRS;
+    size_t cumsz = (z->npairs + 1) * sizeof(double);
+    z->cumulative = aligned_alloc(CACHE_LINE_SIZE, 
+        (cumsz + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+    z->buckets = malloc((z->npairs + 1) * sizeof(struct zbucket));
+    assert(z->cumulative && z->buckets);
 
-    // Calculate the total probability distribution
-    double H_Ns = 0;
-    long i = 0;
-    for (i=0; i<N; i++) {
-	H_Ns += pow(i+1, -s);
-    }
+    double *cum = malloc(z->npairs * sizeof(double));
+    struct zbucket *b = malloc(z->npairs * sizeof(struct zbucket));
+    assert(cum && b);
 
-    // For the first half of the pairs do things exactly
+    // The first half of the buckets (or all of them, for small universes) 
+    // hold one element each and are done exactly.
+    long nexact = (N <= NPAIRS) ? N : NPAIRS/2;
     double cumulative = 0;
-    for (i=0; i<NPAIRS/2; i++) {
-	z->pairs[i] = (struct zpair){.cumulative = cumulative,
-				     .low        = i,
-				     .num        = 1};
-	cumulative += pow(i+1, -s);
+    long i;
+    for (i=0; i<nexact; i++) {
+        cum[i] = cumulative;
+        b[i] = (struct zbucket){.low = i, .num = 1};
+        cumulative += zr_h(s, i+1);
     }
-    // For the second half divide up the remaining part of N evenly by the probability.
-    
-
-    long last_n = NPAIRS/2;
-    long next_n = last_n;
-
-    for (i=NPAIRS/2; i<NPAIRS; i++) {
-	double remaining_probability = H_Ns - cumulative;
-	double next_target = cumulative + remaining_probability/(NPAIRS-i);
-	double next_cumulative = cumulative;
-	while (next_n < N && next_cumulative < next_target) {
-	    next_cumulative += pow(next_n+1, -s);
-	    next_n++;
-	}
-	z->pairs[i] = (struct zpair){.cumulative = cumulative,
-				     .low        = last_n,
-				     .num        = next_n - last_n};
-	last_n = next_n;
-	cumulative = next_cumulative;
+
+    // The rest divide the remaining probability evenly. The tail sums have
+    // a closed form, so this is O(NPAIRS) rather than O(N) calls to pow().
+    double tail = (N > nexact) ? zr_tail(s, nexact, N) : 0;
+    double H_Ns = cumulative + tail;
+    long last_n = nexact;
+    for (i=nexact; i<z->npairs; i++) {
+        long left = z->npairs - i;   // buckets left, including this one
+        long next_n = N;
+        cum[i] = H_Ns - tail;
+        if (left > 1) {
+            next_n = zr_tail_inv(s, N, tail - tail / left, last_n + 1, N - left + 1);
+            tail = zr_tail(s, next_n, N);
+        }
+        b[i] = (struct zbucket){.low = last_n, .num = next_n - last_n};
+        last_n = next_n;
     }
     z->H_Ns = H_Ns;
 
+    eytzinger_fill(cum, b, z);
+    free(cum);
+    free(b);
+
     if (0) zprint(z);
 
     return z;
 }
 
-static long z_search (ZIPFIAN s, double C, long low, long pcount) 
-// Find the first zpair for which the cumulative probability of the previous pairs is less than C.
-// Generate a value in its range uniformly randomly.
-{
-    assert(pcount>0);
-    if (pcount==1) {
-	struct zpair const *p = &s->pairs[low];
-	assert(p->cumulative <= C);
-	return p->low + random_gen((struct zipfian*)s) % p->num;	
-    } else {
-	long mid = low + pcount/2;
-	struct zpair const *p = &s->pairs[mid];
-	if (p->cumulative > C) {
-	    return z_search(s, C, low, pcount/2);
-	} else {
-	    return z_search(s, C, low+pcount/2, pcount-pcount/2);
-	}
+long zipfian_gen (ZIPFIAN z, struct syn_rand_state *rs) {
+    // Find the last bucket whose cumulative probability is at most C; 
+    // then pick a value in its range uniformly at random.
+    double C = (syn_rand_next(rs) >> 11) * 0x1.0p-53 * z->H_Ns;
+    long k = 1;
+    while (k <= z->npairs) {
+        __builtin_prefetch(z->cumulative + 16 * k);
+        k = 2 * k + (z->cumulative[k] <= C);
     }
-}
-
-long zipfian_gen (ZIPFIAN z) {
-    // we're going to have to use two calls to random() to get enough random bits.
-    const long rand_limit = ((long)RAND_MAX)+1;
-    const double one_over = 1/(double)rand_limit;
-    const double scale_factor = one_over * one_over;
-    long v = (long)(random_gen((struct zipfian*)z)) * rand_limit + random_gen((struct zipfian*)z);
-    double scaled = v * z->H_Ns * scale_factor;
-    return z_search(z, scaled, 0, NPAIRS);
+    // the last right turn on the way down is the predecessor
+    k >>= __builtin_ffsl(k);
+    struct zbucket const *p = &z->buckets[k];
+    assert(k > 0 && z->cumulative[k] <= C);
+    return p->low + ((p->num > 1) ? syn_rand_next(rs) % p->num : 0);
 }
 
 void destroy_zipfian (ZIPFIAN z) {
+    free(z->cumulative);
+    free(z->buckets);
     free((struct zipfian *)z);
 }
 
+void zipf_sampler_init (struct zipf_sampler *z, double s, long N) {
+    assert(s >= 0);
+    assert(0 < N);
+    z->s = s;
+    z->N = N;
+    z->h_x1 = zr_H(s, 1.5) - 1;
+    z->h_n = zr_H(s, N + 0.5);
+    z->s_param = 2 - zr_Hinv(s, zr_H(s, 2.5) - zr_h(s, 2));
+}
+
+long zipf_sampler_next (const struct zipf_sampler *z, struct syn_rand_state *rs) {
+    double u, x;
+    long k;
+    while (1) {
+        // uniform in (H(N + 0.5), H(1.5) - 1]; invert H and round to the nearest integer
+        u = z->h_n + (syn_rand_next(rs) >> 11) * 0x1.0p-53 * (z->h_x1 - z->h_n);
+        x = zr_Hinv(z->s, u);
+        k = (long)(x + 0.5);
+        if (k < 1) k = 1;
+        else if (k > z->N) k = z->N;
+        // accept right away when far enough from the rounding boundary, otherwise 
+        // if u falls under the histogram of the actual probability at k
+        if (k - x <= z->s_param || u >= zr_H(z->s, k + 0.5) - zr_h(z->s, k))
+            return k - 1;
+    }
+}
+
 void generate_random_keys (uint64_t *elems, long N, long gencount, double s) {
 	int i;
 	uint32_t *counts;
@@ -153,13 +220,15 @@ void generate_random_keys (uint64_t *elems, long N, long gencount, double s) {
 	printf("Generating %ld elements in universe of %ld items with characteristic exponent %f\n",
 				 gencount, N, s);
 	/*gettimeofday(&a, NULL);*/
-	ZIPFIAN z = create_zipfian(s, N, time(NULL));
+	struct syn_rand_state rs;
+	ZIPFIAN z = create_zipfian(s, N);
+	ASSERTZ(syn_rand_seed(&rs, time(NULL)));
 	counts = (uint32_t*)calloc(N, sizeof(counts));
 
 	/*gettimeofday(&b, NULL);*/
 	/*printf("Setup time    = %0.6fs\n", tdiff(&a, &b));*/
 	for (i=0; i<gencount; i++) {
-		long g = zipfian_gen(z);
+		long g = zipfian_gen(z, &rs);
 		assert(0<=g && g<N);
 		counts[g]++;
 		elems[i] = g;
@@ -8,8 +8,9 @@
  * There are two parameters:
  *   s the characteristic exponent, and
  *   N the number of elements in the universe.
- * Once created, this data structure is read-only, and can be used in a multithreaded fashion.  This code
- *  calls random(), which is generally multihread-safe these days.
+ * Once created, this data structure is read-only, and can be shared by threads: build it once and 
+ *  have each thread draw with its own random state.  Construction is O(NPAIRS) (not O(N)), using a 
+ *  closed form for the tail of the harmonic sum.
  *
  * Copyright 2011 Bradley C. Kuszmaul 
  */
@@ -20,23 +21,45 @@
 extern "C" {
 #endif
 
+struct syn_rand_state;
 typedef struct zipfian const *ZIPFIAN;
-ZIPFIAN create_zipfian (double s, long N,  unsigned long seed);
+ZIPFIAN create_zipfian (double s, long N);
 // Effect: Create a generator of zipfian numbers.
 
 void destroy_zipfian (const ZIPFIAN);
 // Effect; Destroy the zipfian generator (freeing all it's memory, for example).
 
-long zipfian_gen (const ZIPFIAN);
+long zipfian_gen (const ZIPFIAN, struct syn_rand_state *);
 // Effect: return a number from 0 (inclusive) to N (exlusive) with probability distribution approximately as follows.
 //   $k-1$ is returned with probability  $1/(k^s H_{N,s})$
 //   where $H_{N,s}$ is the $N$th generalized harmonic number $\sum_{n=1}^{N} 1/n^s$.
+//   Random bits are drawn from the given state, one per calling thread.
 
 long zipfian_hash (const ZIPFIAN);
 // Effect: Return a random 64-bit number.  The numbers themselves are uniform hashes of the numbers from 0 (inclusive) to N (exclusive)
 
 void generate_random_keys (uint64_t *elems, long N, long gencount, double s);
 
+/* Streaming zipfian sampler using rejection-inversion (Hormann and Derflinger, 
+ * "Rejection-inversion to generate variates from monotone discrete 
+ * distributions", 1996). Same distribution as above, but O(1) time and space: 
+ * no table, a handful of log/exp calls per draw and rarely a retry. Once 
+ * initialized it is read-only and can be shared by threads, each bringing 
+ * its own random state. */
+struct zipf_sampler {
+    double s;                    // s, the characteristic exponent.
+    long N;                      // N, the size of the universe.
+    double h_x1;                 // H(1.5) - 1
+    double h_n;                  // H(N + 0.5)
+    double s_param;              // acceptance shortcut (2 - Hinv(H(2.5) - h(2)))
+};
+
+void zipf_sampler_init (struct zipf_sampler *, double s, long N);
+// Effect: Set up a sampler for numbers from 0 (inclusive) to N (exclusive), distributed as for zipfian_gen().
+
+long zipf_sampler_next (const struct zipf_sampler *, struct syn_rand_state *);
+// Effect: return the next number, drawing random bits from the given state.
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,471 @@
+/*
+ * ztier.c - a compressed in-memory tier (zswap-like) standing in for
+ * far memory, on top of userfaultfd and snappy
+ *
+ * Regions from ztier_malloc are registered for missing and write-protect
+ * faults. A single handler thread serves all faults:
+ *  - a page never touched before is filled with zeros
+ *  - a compressed page is decompressed from the pool and mapped back
+ * and then keeps the resident pages under the budget by evicting the
+ * oldest fault-ins (FIFO; user space can't see accessed bits). To evict,
+ * it write-protects the page, compresses it into the pool and drops it
+ * with MADV_DONTNEED. A thread writing to the page meanwhile blocks on
+ * the write-protect fault, which is served like any other fault once
+ * the page is gone, so no write is lost.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "utils.h"
+#include "snappy.h"
+#include "ztier.h"
+
+#define ZT_MAX_REGIONS		64
+#define ZT_EVICT_BATCH		16
+#define ZT_MSG_BATCH		16
+
+/* compressed pool: slots are carved out of slabs in 64-byte size
+ * classes; freed slots go on a per-class free list */
+#define ZT_CLASS_SHIFT		6
+#define ZT_NCLASSES			(PAGE_SIZE >> ZT_CLASS_SHIFT)
+#define ZT_SLAB_SIZE		(1ul << 20)
+
+enum {
+	ZT_MISSING = 0,		/* never touched, reads as zeros */
+	ZT_RESIDENT,
+	ZT_COMPRESSED,
+};
+
+struct zt_page {
+	void* zdata;		/* slot in the pool when compressed */
+	uint16_t zlen;		/* PAGE_SIZE if stored as is */
+	uint8_t state;
+};
+
+struct zt_region {
+	unsigned long start;
+	unsigned long npages;
+	struct zt_page* pages;
+};
+
+struct zt_pool {
+	void* free[ZT_NCLASSES];
+	char* slab[ZT_NCLASSES];
+	size_t slab_left[ZT_NCLASSES];
+	size_t slot_bytes;		/* in live slots */
+	size_t slab_bytes;		/* total footprint */
+};
+
+struct zt_stats {
+	uint64_t zero_faults;
+	uint64_t zfaults;		/* faults served from the pool */
+	uint64_t stale_faults;	/* page was already back */
+	uint64_t evictions;
+	uint64_t stored_pages;	/* currently in the pool */
+	uint64_t stored_zbytes;	/* their compressed size */
+	uint64_t total_in;		/* over all evictions */
+	uint64_t total_zbytes;
+	struct lat_hist decomp;	/* decompression latency, in cycles */
+};
+
+static struct {
+	int uffd;
+	pthread_t handler;
+	pthread_mutex_t lock;
+	struct zt_region regions[ZT_MAX_REGIONS];
+	int nregions;
+
+	unsigned long budget;	/* in pages */
+	unsigned long nresident;
+	/* resident pages in fault-in order; may hold stale entries */
+	unsigned long* fifo;
+	unsigned long fifo_cap, fifo_head, fifo_tail;
+
+	struct zt_pool pool;
+	struct snappy_env env;
+	char* zbuf;
+	char* pagebuf;
+	struct zt_stats stats;
+} zt;
+
+/* compressed pool */
+static void* zt_pool_alloc(size_t len)
+{
+	int c = (len - 1) >> ZT_CLASS_SHIFT;
+	size_t slot = (size_t)(c + 1) << ZT_CLASS_SHIFT;
+	void* p;
+
+	if (zt.pool.free[c]) {
+		p = zt.pool.free[c];
+		zt.pool.free[c] = *(void**)p;
+	} else {
+		if (zt.pool.slab_left[c] < slot) {
+			zt.pool.slab[c] = malloc(ZT_SLAB_SIZE);
+			ASSERT(zt.pool.slab[c]);
+			zt.pool.slab_left[c] = ZT_SLAB_SIZE;
+			zt.pool.slab_bytes += ZT_SLAB_SIZE;
+		}
+		p = zt.pool.slab[c];
+		zt.pool.slab[c] += slot;
+		zt.pool.slab_left[c] -= slot;
+	}
+	zt.pool.slot_bytes += slot;
+	return p;
+}
+
+static void zt_pool_free(void* p, size_t len)
+{
+	int c = (len - 1) >> ZT_CLASS_SHIFT;
+
+	*(void**)p = zt.pool.free[c];
+	zt.pool.free[c] = p;
+	zt.pool.slot_bytes -= (size_t)(c + 1) << ZT_CLASS_SHIFT;
+}
+
+/* finds the page, with the lock held */
+static struct zt_page* zt_lookup(unsigned long addr)
+{
+	struct zt_region* r;
+	int i;
+
+	for (i = 0; i < zt.nregions; i++) {
+		r = &zt.regions[i];
+		if (addr >= r->start && addr < r->start + r->npages * PAGE_SIZE)
+			return &r->pages[(addr - r->start) >> _PAGE_SHIFT];
+	}
+	return NULL;
+}
+
+static void zt_fifo_push(unsigned long addr)
+{
+	unsigned long i, n, *fifo;
+
+	if (zt.fifo_tail - zt.fifo_head == zt.fifo_cap) {
+		/* full: grow, unwrapping the ring */
+		n = zt.fifo_cap ? 2 * zt.fifo_cap : 1024;
+		fifo = malloc(n * sizeof(*fifo));
+		ASSERT(fifo);
+		for (i = zt.fifo_head; i < zt.fifo_tail; i++)
+			fifo[i - zt.fifo_head] = zt.fifo[i % zt.fifo_cap];
+		free(zt.fifo);
+		zt.fifo = fifo;
+		zt.fifo_tail -= zt.fifo_head;
+		zt.fifo_head = 0;
+		zt.fifo_cap = n;
+	}
+	zt.fifo[zt.fifo_tail++ % zt.fifo_cap] = addr;
+}
+
+static int zt_wrprotect(unsigned long addr)
+{
+	struct uffdio_writeprotect wp = {
+		.range = { .start = addr, .len = PAGE_SIZE },
+		.mode = UFFDIO_WRITEPROTECT_MODE_WP,
+	};
+	return ioctl(zt.uffd, UFFDIO_WRITEPROTECT, &wp);
+}
+
+/* compress the oldest resident page into the pool and drop it */
+static void zt_evict_one(void)
+{
+	unsigned long addr;
+	struct zt_page* p;
+	size_t zlen;
+	int ret;
+
+	do {
+		if (zt.fifo_head == zt.fifo_tail)
+			return;
+		addr = zt.fifo[zt.fifo_head++ % zt.fifo_cap];
+		p = zt_lookup(addr);
+	} while (!p || p->state != ZT_RESIDENT);
+
+	/* no writes from here on; readers may carry on until it's dropped */
+	ret = zt_wrprotect(addr);
+	ASSERTZ(ret);
+	ret = snappy_compress(&zt.env, (char*) addr, PAGE_SIZE, zt.zbuf, &zlen);
+	ASSERTZ(ret);
+	if (zlen >= PAGE_SIZE) {
+		/* incompressible: store as is */
+		zlen = PAGE_SIZE;
+		p->zdata = zt_pool_alloc(zlen);
+		memcpy(p->zdata, (void*) addr, PAGE_SIZE);
+	} else {
+		p->zdata = zt_pool_alloc(zlen);
+		memcpy(p->zdata, zt.zbuf, zlen);
+	}
+	p->zlen = zlen;
+	ret = madvise((void*) addr, PAGE_SIZE, MADV_DONTNEED);
+	ASSERTZ(ret);
+	p->state = ZT_COMPRESSED;
+	zt.nresident--;
+
+	zt.stats.evictions++;
+	zt.stats.stored_pages++;
+	zt.stats.stored_zbytes += zlen;
+	zt.stats.total_in += PAGE_SIZE;
+	zt.stats.total_zbytes += zlen;
+}
+
+/* serve a fault on a page, with the lock held */
+static void zt_fault(unsigned long addr)
+{
+	struct uffdio_copy copy;
+	struct uffdio_range range;
+	struct zt_page* p;
+	uint64_t start;
+	int ret;
+
+	addr &= _PAGE_MASK;
+	p = zt_lookup(addr);
+	BUG_ON(!p);
+
+	switch (p->state) {
+	case ZT_RESIDENT:
+		/* someone else's fault brought it back already, or this is a
+		 * write that raced with an eviction that didn't happen */
+		zt.stats.stale_faults++;
+		range.start = addr;
+		range.len = PAGE_SIZE;
+		ioctl(zt.uffd, UFFDIO_WAKE, &range);
+		return;
+	case ZT_MISSING:
+		memset(zt.pagebuf, 0, PAGE_SIZE);
+		zt.stats.zero_faults++;
+		break;
+	case ZT_COMPRESSED:
+		start = rdtsc();
+		if (p->zlen == PAGE_SIZE)
+			memcpy(zt.pagebuf, p->zdata, PAGE_SIZE);
+		else {
+			ret = snappy_uncompress(p->zdata, p->zlen, zt.pagebuf);
+			ASSERTZ(ret);
+		}
+		lat_hist_add(&zt.stats.decomp, rdtscp(NULL) - start);
+		zt_pool_free(p->zdata, p->zlen);
+		zt.stats.zfaults++;
+		zt.stats.stored_pages--;
+		zt.stats.stored_zbytes -= p->zlen;
+		p->zdata = NULL;
+		break;
+	}
+
+	/* map it in, which also wakes up the faulting threads */
+	copy.dst = addr;
+	copy.src = (unsigned long) zt.pagebuf;
+	copy.len = PAGE_SIZE;
+	copy.mode = 0;
+	do {
+		ret = ioctl(zt.uffd, UFFDIO_COPY, &copy);
+	} while (ret < 0 && errno == EAGAIN);
+	ASSERTZ(ret);
+
+	p->state = ZT_RESIDENT;
+	zt.nresident++;
+	zt_fifo_push(addr);
+	if (zt.budget && zt.nresident > zt.budget) {
+		int i;
+		for (i = 0; i < ZT_EVICT_BATCH && zt.nresident > zt.budget; i++)
+			zt_evict_one();
+	}
+}
+
+static void* zt_handler(void* arg)
+{
+	struct uffd_msg msgs[ZT_MSG_BATCH];
+	struct pollfd pfd = { .fd = zt.uffd, .events = POLLIN };
+	ssize_t n;
+	int i;
+
+	while (true) {
+		if (poll(&pfd, 1, -1) < 0) {
+			ASSERT(errno == EINTR);
+			continue;
+		}
+		n = read(zt.uffd, msgs, sizeof(msgs));
+		if (n < 0) {
+			ASSERT(errno == EAGAIN || errno == EINTR);
+			continue;
+		}
+		pthread_mutex_lock(&zt.lock);
+		for (i = 0; i < n / sizeof(msgs[0]); i++)
+			if (msgs[i].event == UFFD_EVENT_PAGEFAULT)
+				zt_fault(msgs[i].arg.pagefault.address);
+		pthread_mutex_unlock(&zt.lock);
+	}
+	return NULL;
+}
+
+/**
+ * ztier_init - sets up userfaultfd and starts the fault handler. The
+ * budget comes from ZTIER_LOCAL_MEM (bytes) in the environment, if set
+ */
+int ztier_init(void)
+{
+	struct uffdio_api api = { .api = UFFD_API };
+	char* lmem;
+	int ret;
+
+	zt.uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (zt.uffd < 0) {
+		pr_err("userfaultfd failed");
+		return -errno;
+	}
+	if (ioctl(zt.uffd, UFFDIO_API, &api) < 0) {
+		pr_err("UFFDIO_API failed");
+		return -errno;
+	}
+
+	lmem = getenv("ZTIER_LOCAL_MEM");
+	ztier_set_local_mem(lmem ? strtoul(lmem, NULL, 0) : ZTIER_DEFAULT_LOCAL_MEM);
+	ret = snappy_init_env(&zt.env);
+	if (ret)
+		return ret;
+	zt.zbuf = malloc(snappy_max_compressed_length(PAGE_SIZE));
+	zt.pagebuf = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	if (!zt.zbuf || !zt.pagebuf)
+		return -ENOMEM;
+	lat_hist_init(&zt.stats.decomp);
+	pthread_mutex_init(&zt.lock, NULL);
+
+	ret = pthread_create(&zt.handler, NULL, zt_handler, NULL);
+	if (ret)
+		return -ret;
+	pr_info("ztier: local memory budget %lu MB",
+		zt.budget * PAGE_SIZE / (1 << 20));
+	return 0;
+}
+
+/**
+ * ztier_malloc - allocates page-aligned memory backed by the tier
+ */
+void* ztier_malloc(size_t size)
+{
+	struct uffdio_register reg;
+	struct zt_region* r;
+	unsigned long npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	void* addr;
+
+	addr = mmap(NULL, npages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	reg.range.start = (unsigned long) addr;
+	reg.range.len = npages * PAGE_SIZE;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+	if (ioctl(zt.uffd, UFFDIO_REGISTER, &reg) < 0) {
+		pr_err("UFFDIO_REGISTER failed");
+		goto unmap;
+	}
+
+	pthread_mutex_lock(&zt.lock);
+	if (zt.nregions == ZT_MAX_REGIONS) {
+		pthread_mutex_unlock(&zt.lock);
+		pr_err("ztier: too many regions");
+		goto unmap;
+	}
+	r = &zt.regions[zt.nregions];
+	r->pages = calloc(npages, sizeof(struct zt_page));
+	if (!r->pages) {
+		pthread_mutex_unlock(&zt.lock);
+		goto unmap;
+	}
+	r->start = (unsigned long) addr;
+	r->npages = npages;
+	zt.nregions++;
+	pthread_mutex_unlock(&zt.lock);
+	return addr;
+
+unmap:
+	munmap(addr, npages * PAGE_SIZE);
+	return NULL;
+}
+
+/**
+ * ztier_free - releases memory from ztier_malloc, resident or not
+ */
+void ztier_free(void* ptr)
+{
+	struct zt_region* r;
+	unsigned long i;
+	int j;
+
+	pthread_mutex_lock(&zt.lock);
+	for (j = 0; j < zt.nregions; j++)
+		if (zt.regions[j].start == (unsigned long) ptr)
+			break;
+	BUG_ON(j == zt.nregions);
+	r = &zt.regions[j];
+
+	for (i = 0; i < r->npages; i++) {
+		if (r->pages[i].state == ZT_RESIDENT)
+			zt.nresident--;
+		else if (r->pages[i].state == ZT_COMPRESSED) {
+			zt_pool_free(r->pages[i].zdata, r->pages[i].zlen);
+			zt.stats.stored_pages--;
+			zt.stats.stored_zbytes -= r->pages[i].zlen;
+		}
+	}
+	/* munmap also unregisters; fifo entries left behind are skipped */
+	munmap(ptr, r->npages * PAGE_SIZE);
+	free(r->pages);
+	*r = zt.regions[--zt.nregions];
+	pthread_mutex_unlock(&zt.lock);
+}
+
+/**
+ * ztier_set_local_mem - sets the budget for resident pages (0 for none).
+ * A lower budget takes effect on the next faults
+ */
+void ztier_set_local_mem(unsigned long bytes)
+{
+	zt.budget = bytes / PAGE_SIZE;
+}
+
+/* resident memory, in bytes; the pool is not included */
+unsigned long ztier_local_mem(void)
+{
+	return zt.nresident * PAGE_SIZE;
+}
+
+/**
+ * ztier_print_stats - prints faults, compression ratio and decompression
+ * latency so far
+ */
+void ztier_print_stats(uint64_t cycles_per_us)
+{
+	struct zt_stats* s = &zt.stats;
+
+	pthread_mutex_lock(&zt.lock);
+	pr_info("ztier: %lu faults (%lu zero-fill, %lu decompress, %lu stale), "
+		"%lu evictions", s->zero_faults + s->zfaults + s->stale_faults,
+		s->zero_faults, s->zfaults, s->stale_faults, s->evictions);
+	pr_info("ztier: resident %lu MB, pool holds %lu pages in %lu MB "
+		"(slots %lu MB, slabs %lu MB)",
+		ztier_local_mem() / (1 << 20), s->stored_pages,
+		s->stored_zbytes / (1 << 20), zt.pool.slot_bytes / (1 << 20),
+		zt.pool.slab_bytes / (1 << 20));
+	if (s->total_zbytes)
+		pr_info("ztier: compression ratio %.2f (%.2f with pool overhead)",
+			s->total_in * 1.0 / s->total_zbytes,
+			zt.pool.slab_bytes ? s->stored_pages * PAGE_SIZE * 1.0
+				/ zt.pool.slab_bytes : 0);
+	if (s->decomp.count)
+		pr_info("ztier: decompression in µs: %.2lf (p50), %.2lf (p99), "
+			"%.2lf (max)",
+			lat_hist_percentile(&s->decomp, 50) * 1.0 / cycles_per_us,
+			lat_hist_percentile(&s->decomp, 99) * 1.0 / cycles_per_us,
+			s->decomp.max * 1.0 / cycles_per_us);
+	printf("ztier_faults:%lu\n", s->zero_faults + s->zfaults + s->stale_faults);
+	printf("ztier_zfaults:%lu\n", s->zfaults);
+	printf("ztier_ratio:%.2f\n", s->total_zbytes ?
+		s->total_in * 1.0 / s->total_zbytes : 0);
+	pthread_mutex_unlock(&zt.lock);
+}
@@ -0,0 +1,26 @@
+/*
+ * ztier.h - a compressed in-memory tier (zswap-like) standing in for
+ * far memory. Memory from ztier_malloc is registered with userfaultfd
+ * and kept under a local memory budget: once too many of its pages are
+ * resident, the oldest ones are compressed with snappy into an
+ * in-memory pool and unmapped, to be decompressed on the next access.
+ * Needs no RDMA hardware, only userfaultfd (with write-protect support)
+ */
+
+#ifndef __ZTIER_H__
+#define __ZTIER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* local memory budget, in bytes, when ZTIER_LOCAL_MEM is not set */
+#define ZTIER_DEFAULT_LOCAL_MEM		(1ull << 30)
+
+int ztier_init(void);
+void* ztier_malloc(size_t size);
+void ztier_free(void* ptr);
+void ztier_set_local_mem(unsigned long bytes);
+unsigned long ztier_local_mem(void);
+void ztier_print_stats(uint64_t cycles_per_us);
+
+#endif  // __ZTIER_H__
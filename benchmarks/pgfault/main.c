@@ -130,6 +130,7 @@ struct thread_data {
     unsigned long end_tsc;
     unsigned long latencies[NSAMPLES_PER_THREAD];
     int nlatencies;
+    struct lat_hist hist;       /* latency of every fault, in cycles */
 } CACHE_ALIGN;
 typedef struct thread_data thread_data_t;
 
@@ -163,7 +164,7 @@ void* thread_main(void* arg)
 {
     void *start, *addr;
     unsigned long npages;
-    unsigned long now_tsc;
+    unsigned long now_tsc, fault_tsc, lat;
     int rdahead_skip, rdahead_next, samples;
     double duration_secs, sampling_rate;
     unsigned long randomness, next_sample;
@@ -247,6 +248,7 @@ void* thread_main(void* arg)
         }
 
         /* perform access/trigger fault */
+        fault_tsc = RDTSC();
         switch (cur_op) {
             case FO_READ:
                 hint_read_fault_rdahead(addr, rdahead_next);
@@ -265,9 +267,12 @@ void* thread_main(void* arg)
                 _BUG();	/* bug */
         }
 
-        /* note down latency */
+        /* note down latency: every fault goes into the histogram, 
+         * poisson-sampled ones are also kept raw */
+        lat = RDTSCP(NULL) - fault_tsc;
+        lat_hist_add(&targs->hist, lat);
         if (now_tsc && samples < NSAMPLES_PER_THREAD) {
-            targs->latencies[samples] = (RDTSCP(NULL) - now_tsc);
+            targs->latencies[samples] = lat;
             samples++;
         }
 
@@ -303,6 +308,44 @@ void* thread_main(void* arg)
     return NULL;
 }
 
+/* print fault latency percentiles and write the CDF buckets (in ns) of 
+ * the merged per-thread histograms (NOTE: this will overwrite the same 
+ * file if called multiple times) */
+void dump_latency_hist(thread_data_t* targs, int nthreads)
+{
+    static const double pcts[] = { 50, 90, 99, 99.9, 99.99 };
+    struct lat_hist hist;
+    unsigned long seen, val;
+    FILE* outfile;
+    int i;
+
+    lat_hist_init(&hist);
+    for (i = 0; i < nthreads; i++)
+        lat_hist_merge(&hist, &targs[i].hist);
+    if (hist.count == 0)
+        return;
+
+    for (i = 0; i < (int) (sizeof(pcts) / sizeof(pcts[0])); i++)
+        pr_info("fault latency p%g: %lu ns", pcts[i],
+            lat_hist_percentile(&hist, pcts[i]) * 1000 / CYCLES_PER_US);
+    pr_info("fault latency max: %lu ns over %lu faults", 
+        hist.max * 1000 / CYCLES_PER_US, hist.count);
+
+    outfile = fopen("latency_hist", "w");
+    ASSERT(outfile);
+    fprintf(outfile, "latency,count,cdf\n");
+    seen = 0;
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        if (!hist.buckets[i])
+            continue;
+        seen += hist.buckets[i];
+        val = lat_hist_value(i) < hist.max ? lat_hist_value(i) : hist.max;
+        fprintf(outfile, "%lu,%lu,%.6lf\n", val * 1000 / CYCLES_PER_US, 
+            hist.buckets[i], seen * 1.0 / hist.count);
+    }
+    fclose(outfile);
+}
+
 /* thread to signal timeout */
 void* timeout_thread(void* arg) {
 	unsigned long sleep_us = (unsigned long) arg;
@@ -333,6 +376,7 @@ struct run_result do_work(thread_data_t* targs, int nthreads, enum fault_op op,
         targs[i].op = op;
         targs[i].rdahead = rdahead;
         targs[i].sample_lat = sample_lat;
+        lat_hist_init(&targs[i].hist);
         ret = pthread_create(&pthreads[i], NULL, thread_main, &targs[i]);
         ASSERTZ(ret);
     }
@@ -375,6 +419,8 @@ struct run_result do_work(thread_data_t* targs, int nthreads, enum fault_op op,
         pr_info("Wrote %d sampled latencies", samples);
     }
 
+    dump_latency_hist(targs, nthreads);
+
     pr_info("worked on %lu pages for %.1lf secs", npages, time_secs);
     result.npages = npages;
     result.time_secs = time_secs;
@@ -407,10 +453,9 @@ int main(int argc, char *argv[])
     /* number of worker threads */
     nthreads = NTHREADS;
 
-    /* sample latencies */
+    /* sample raw latencies too (the histogram is always on) */
     sample_lat = false;
 #ifdef LATENCY
-    nthreads = 1;
     sample_lat = true;
 #endif
     
@@ -348,11 +348,6 @@ if [[ $BUILD_ONLY ]]; then
     exit 0
 fi
 
-if [[ $LATENCIES ]] && [ $NCORES -gt 1 ]; then
-    echo "can't do more than 1 thr with latency sampling"
-    exit 1
-fi
-
 # prepare remote memory servers for the run
 if [[ $RMEM ]] && [ "$BACKEND" == "rdma" ]; then
     echo "starting rmem servers"
@@ -21,6 +21,7 @@
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <math.h>
 
 #include "log.h"
 
@@ -99,6 +100,47 @@ uint64_t app_rand_next(struct app_rand_state* state) {
 	return result;
 }
 
+void lat_hist_init(struct lat_hist* hist) {
+	memset(hist, 0, sizeof(struct lat_hist));
+}
+
+void lat_hist_merge(struct lat_hist* dst, const struct lat_hist* src) {
+	int i;
+	for (i = 0; i < LAT_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* highest value in the bucket of the given index */
+unsigned long lat_hist_value(unsigned int idx) {
+	unsigned int shift;
+	if (idx < LAT_HIST_SUB)
+		return idx;
+	shift = (idx >> LAT_HIST_SUB_BITS) - 1;
+	return (((unsigned long)(idx & (LAT_HIST_SUB - 1)) + LAT_HIST_SUB + 1) << shift) - 1;
+}
+
+/* value at the given percentile (0-100), to within a bucket */
+unsigned long lat_hist_percentile(const struct lat_hist* hist, double pct) {
+	unsigned long rank, seen = 0;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+	rank = (unsigned long) ceil(pct / 100.0 * hist->count);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return (lat_hist_value(i) < hist->max) ? 
+				lat_hist_value(i) : hist->max;
+	}
+	return hist->max;
+}
+
 void dump_stack() {
   void *trace[16];
   char **messages = (char **)NULL;